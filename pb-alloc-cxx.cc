@@ -0,0 +1,131 @@
+/**
+ * pb-alloc-cxx.cc
+ *
+ * operator new and delete on top of pb-alloc, so C++ programs get every allocation from it whether it is
+ * linked in or preloaded. Every replaceable form is defined, including the sized and aligned ones of C++14 and
+ * C++17, since a program that only replaced some of them would hand blocks from one allocator to the other.
+ *
+ * As the standard asks, the throwing forms call the new handler until it frees enough memory or gives up, and
+ * throw std::bad_alloc if there is no handler. The nothrow forms return NULL instead. The sized forms of
+ * operator delete pass the size on to free_sized(), which saves the small ones a header read.
+ **/
+
+#include <cstdlib>
+#include <new>
+
+#include "pb-alloc.h"
+
+
+
+//allocates (size) bytes aligned to (alignment), or to the default alignment when it is 0
+static inline void* pb_new (std::size_t size, std::size_t alignment) {
+  return alignment == 0 ? malloc(size) : aligned_alloc(alignment, size);
+}
+
+//allocates the way operator new must, retrying through the new handler
+static void* pb_new_throw (std::size_t size, std::size_t alignment) {
+
+  for (;;) {
+    void* ptr = pb_new(size, alignment);
+    if (ptr != NULL) {
+      return ptr;
+    }
+
+    std::new_handler handler = std::get_new_handler();
+    if (handler == NULL) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+//allocates the way the nothrow forms of operator new must
+static void* pb_new_nothrow (std::size_t size, std::size_t alignment) noexcept {
+  try {
+    return pb_new_throw(size, alignment);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+
+void* operator new (std::size_t size) {
+  return pb_new_throw(size, 0);
+}
+
+void* operator new[] (std::size_t size) {
+  return pb_new_throw(size, 0);
+}
+
+void* operator new (std::size_t size, const std::nothrow_t&) noexcept {
+  return pb_new_nothrow(size, 0);
+}
+
+void* operator new[] (std::size_t size, const std::nothrow_t&) noexcept {
+  return pb_new_nothrow(size, 0);
+}
+
+void* operator new (std::size_t size, std::align_val_t alignment) {
+  return pb_new_throw(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[] (std::size_t size, std::align_val_t alignment) {
+  return pb_new_throw(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new (std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return pb_new_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[] (std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return pb_new_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+
+void operator delete (void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[] (void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete (void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+void operator delete[] (void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+void operator delete (void* ptr, std::size_t size) noexcept {
+  free_sized(ptr, size);
+}
+
+void operator delete[] (void* ptr, std::size_t size) noexcept {
+  free_sized(ptr, size);
+}
+
+void operator delete (void* ptr, std::align_val_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[] (void* ptr, std::align_val_t) noexcept {
+  free(ptr);
+}
+
+void operator delete (void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+void operator delete[] (void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+void operator delete (void* ptr, std::size_t size, std::align_val_t alignment) noexcept {
+  free_aligned_sized(ptr, static_cast<std::size_t>(alignment), size);
+}
+
+void operator delete[] (void* ptr, std::size_t size, std::align_val_t alignment) noexcept {
+  free_aligned_sized(ptr, static_cast<std::size_t>(alignment), size);
+}
@@ -1,189 +1,3717 @@
+#define _GNU_SOURCE         //for mremap()
+
 /**
  * pb-malloc.c
  *
- * A pointer-bumping, non-reclaiming memory allocator
- * compile with gcc -std=gnu99 -g -o pb-alloc pb-alloc.c
+ * A general-purpose memory allocator. Small requests are served from per-thread caches in front of size-class
+ * bins and slabs, larger ones from first-fit (or best-fit, or TLSF) free lists whose blocks are split on
+ * allocation and coalesced with their neighbours on free through boundary tags. The heap is split into per-CPU
+ * arenas, with a lock each, that grow in mmap() segments and hand idle pages back to the OS with madvise().
+ * Very large blocks get mappings of their own.
+ * compile with gcc -std=gnu99 -g -pthread -o pb-alloc pb-alloc.c
+ *
+ * make builds libpballoc.so, to preload into existing programs, and libpballoc.a, with operator new and
+ * delete for C++ programs from pb-alloc-cxx.cc. See the Makefile.
  *
  * Documentation by Saharsha Karki, September 2017
  **/
 
 
 
-#include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <strings.h>
-#include <unistd.h>
-#include <sys/mman.h>
+#include <assert.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "pb-alloc.h"
+
+
+
+#define PAGE_SIZE sysconf(_SC_PAGESIZE)
+#define KB(size)  ((size_t)size * 1024)
+#define MB(size)  (KB(size) * 1024)
+#define GB(size)  (MB(size) * 1024)
+
+//keep the paths malloc() and free() rarely take out of line, so their fast paths compile to a few instructions
+//without a stack frame. COLD_PATH also moves the code away from the hot code.
+#define SLOW_PATH __attribute__ ((noinline))
+#define COLD_PATH __attribute__ ((noinline, cold))
+
+
+//formats into a buffer on the stack and writes it to (fd). Reports use this rather than dprintf(), which
+//allocates its stream buffer with malloc() and can land on a lock we hold.
+static void fd_printf (int fd, const char* format, ...) {
+
+  char    buffer[512];
+  va_list args;
+
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  if (length > 0) {
+    write(fd, buffer, (size_t) length < sizeof(buffer) ? (size_t) length : sizeof(buffer) - 1);
+  }
+}
+
+
+/*
+ * Hardening. Building with -DPB_HARDEN makes the allocator check what free() is handed and the lists it
+ * keeps inside freed memory, and abort with a message on stderr as soon as something is wrong, rather than
+ * corrupt the heap further:
+ *
+ *   - the links of the thread caches are stored XORed with their own address shifted right by 12 and with
+ *     harden_key, a random word taken at init() (safe-linking). A pointer written over a cached block by a
+ *     use after free decodes to garbage, which is caught by its alignment before it is followed.
+ *   - every block header has a canary, its address and size XORed with harden_key, checked by free().
+ *   - a double free is caught by the allocated bit of a block header, or the free bit of a slab object,
+ *     and a block freed twice into a thread cache by the mark cached blocks carry in their second word.
+ *   - unlinking a block from a free list checks that its neighbours point back at it.
+ *
+ * pb-bench-hardened, which the Makefile builds next to pb-bench, measures what this costs.
+ */
+#if defined (PB_HARDEN)
+static uintptr_t harden_key;
+
+//reports (what) about the block at (ptr) and aborts
+COLD_PATH static void harden_fail (const char* what, void* ptr) {
+  fd_printf(STDERR_FILENO, "pb-alloc: %s at %p\n", what, ptr);
+  abort();
+}
+#endif
+
+
+/*
+ * Size classes. Requests of up to SMALL_MAX bytes are rounded up to a multiple of ALIGNMENT and
+ * served from an exact-size free list per class, so a small malloc() is a single pop. Larger requests
+ * go through the first-fit list at free_ptr. Building with -DPB_FIRST_FIT puts every freed block on
+ * the first-fit list instead, which is the original single-list allocator.
+ *
+ * The placement policy for the blocks at free_ptr is chosen by init(). Setting PB_FIT=best in the
+ * environment keeps them in a best-fit tree rather than a first-fit list. PB_TLSF builds use TLSF
+ * bins instead of either, see below.
+ */
+#define ALIGNMENT        16
+#define SMALL_MAX        1024
+#define NUM_SIZE_CLASSES (SMALL_MAX / ALIGNMENT)
+#define SLAB_MAX         128                     //largest size served from slabs, see below
+#define SLAB_CLASSES     (SLAB_MAX / ALIGNMENT)
+
+#define FIT_FIRST 0
+#define FIT_BEST  1
+
+static int fit_policy = FIT_FIRST;
+static int stats_at_exit;                        //print malloc_stats() at exit, see Statistics below
+static size_t prof_interval;                     //mean bytes between heap profile samples, 0 when off
+static int trace_fd = -1;                        //file the allocation trace goes to, -1 when off
+static int huge_pages;                           //HUGE_OFF, HUGE_THP or HUGE_TLB, see Segments below
+
+/*
+ * TLSF. Building with -DPB_TLSF replaces the first-fit list (and the best-fit tree) with Two-Level Segregated
+ * Fit bins, so that malloc() and free() take constant time. The first level splits sizes by powers of two and
+ * the second splits each power of two into TLSF_SL_COUNT equal ranges. A bitmap per level says which bins are
+ * non-empty, so finding a bin that fits is two bit scans. Requests are rounded up to the next bin boundary,
+ * which makes any block in that bin a fit, at the cost of at most 1/TLSF_SL_COUNT of internal slack.
+ * Sizes below TLSF_SMALL share the first first-level bin, split linearly. To keep the slow paths bounded too,
+ * these builds free at most REMOTE_DRAIN_MAX remote frees per slow path and never purge on their own; memory
+ * goes back to the OS only through malloc_trim() or pb_mallctl("trim").
+ */
+#define TLSF_SL_LOG2  4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 4)        //log2 of TLSF_SMALL; ALIGNMENT is 1 << 4
+#define TLSF_SMALL    ((size_t)1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (64 - TLSF_FL_SHIFT + 1)
+
+
+//link_s is a structure that will let us construct a linked list for the free types. It contains the size of
+//the blocks, whether the block is in use and the addresses of the next and previous free blocks.
+//
+//Only its first two words are a header that every block carries. tag holds the block's flags in its low bits,
+//which sizes (multiples of ALIGNMENT) never use, and above them the size of the block physically before it
+//while that one is free, or 0 while it is in use. That is the boundary tag that lets free() find the block
+//before and coalesce with it in O(1). next and prev only exist in free blocks, in the first 16 bytes of what is
+//otherwise payload, so an allocated block costs BLOCK_OVERHEAD bytes. A block is laid out as
+//
+//   [ tag | size | size bytes of payload ]
+//
+//Block segments keep room for one header past their last block, so there is always a tag after a block to
+//write to.
+
+typedef struct link {
+#if defined (PB_HARDEN)
+  size_t canary;                 //see Hardening above
+  size_t unused;                 //keeps the payload aligned
+#endif
+  size_t tag;
+  size_t size; 
+  struct link* next; 
+  struct link* prev;
+  
+} link_s; 
+
+#define BLOCK_OVERHEAD offsetof(link_s, next)
+#define BLOCK_IN_USE   1                  //flag of an allocated block, see BLOCK_MAPPED and BLOCK_SAMPLED too
+#define BLOCK_FLAGS    (ALIGNMENT - 1)
+#define MIN_SPLIT      ALIGNMENT     //smallest payload worth splitting off a free block
+
+
+/*
+ * Segments. The heap grows in segments of SEGMENT_SIZE bytes (64 MB unless PB_SEGMENT_SIZE says otherwise),
+ * mapped on demand whenever the bump region of the current segment runs out. Every mapping the allocator
+ * makes is aligned to SEGMENT_SIZE and starts with a segment_s header, so the segment holding any pointer
+ * we hand out is found by masking its address. Blocks never span two segments.
+ *
+ * The kind of a segment says how its memory is carved up: into blocks with link_s headers (SEGMENT_BLOCKS),
+ * into slabs of headerless small objects (SEGMENT_SLABS), or into a single large block (SEGMENT_LARGE).
+ */
+#if !defined (PB_SEGMENT_SIZE)
+#define PB_SEGMENT_SIZE MB(64)
+#endif
+#define SEGMENT_SIZE ((size_t) PB_SEGMENT_SIZE)
+
+#define SEGMENT_BLOCKS 0
+#define SEGMENT_SLABS  1
+#define SEGMENT_LARGE  2
+
+/*
+ * Huge pages. Setting PB_HUGEPAGES=thp asks for transparent huge pages on every segment with
+ * madvise(MADV_HUGEPAGE), and PB_HUGEPAGES=hugetlb maps block and slab segments from the hugetlbfs pool with
+ * MAP_HUGETLB, falling back to an ordinary mapping with the THP hint when the pool runs dry. Segments are
+ * aligned to SEGMENT_SIZE, so they start on a huge page whenever SEGMENT_SIZE is a multiple of HUGE_PAGE_SIZE;
+ * otherwise the option is ignored. A segment records the page size it was mapped with, and purges only
+ * release whole pages of that size, so they neither split a huge page nor ask madvise() for a range hugetlbfs
+ * refuses. Large blocks, which mremap() resizes, only ever get the THP hint.
+ */
+#define HUGE_PAGE_SIZE MB(2)
+
+#define HUGE_OFF 0
+#define HUGE_THP 1
+#define HUGE_TLB 2
+
+typedef struct segment {
+  struct arena*   arena;                     //arena that owns this segment
+  unsigned long   kind;                      //SEGMENT_BLOCKS, SEGMENT_SLABS or SEGMENT_LARGE
+  struct segment* next;                      //next segment of the same arena and kind
+  size_t   size;                             //length of the mapping
+  intptr_t start_ptr;                        //first block
+  intptr_t end_ptr;
+  void*	   last_unallocated_free_ptr;        //bump frontier
+  void*    high_water;                       //furthest the bump frontier has been since the last purge
+  size_t   page_size;                        //PAGE_SIZE, or HUGE_PAGE_SIZE when backed by huge pages
+
+} segment_s;
+
+#define SEGMENT_HEADER_SIZE ((sizeof(segment_s) + 63) & ~(size_t)63)
+
+/*
+ * Large allocations. Requests of mmap_threshold bytes or more (1 MB unless PB_MMAP_THRESHOLD or the
+ * mmap_threshold option says otherwise, see Configuration),
+ * and anything too big for a segment, bypass the arenas. Each one gets a mapping of its own that holds a
+ * segment_s header and that single block, marked BLOCK_MAPPED. free() unmaps it right away and realloc()
+ * resizes it with mremap(), so large buffers never fragment the heap and their memory goes straight
+ * back to the OS. When mremap() cannot resize a mapping in place, it moves it onto a fresh SEGMENT_SIZE-
+ * aligned reservation, so large blocks stay aligned like every other segment without copying any data.
+ */
+#if !defined (PB_MMAP_THRESHOLD)
+#define PB_MMAP_THRESHOLD MB(1)
+#endif
+
+static size_t mmap_threshold = PB_MMAP_THRESHOLD;
+
+//flag of a block that owns a mapping of its own
+#define BLOCK_MAPPED 2
+
+
+/*
+ * Arenas. The heap is split into up to MAX_ARENAS independent arenas, one per CPU by default. Each
+ * arena owns a list of segments, and its arena_s lives in its first segment, right after the segment
+ * header. Every arena has its own lock and free lists. Threads are assigned to arenas round-robin the
+ * first time they reach a slow path, so threads on different arenas never contend.
+ *
+ * A thread that frees a block owned by another arena does not take that arena's lock. It pushes the
+ * block onto the arena's remote_free stack with a single compare-and-swap, and the arena's own threads
+ * take the whole stack with one atomic exchange and free it in a batch on their next slow path. PB_TLSF
+ * builds free at most REMOTE_DRAIN_MAX of those blocks per slow path and keep the rest on remote_pending
+ * for the next one, so that a long stack does not make one malloc() pay for it.
+ *
+ * On a machine with more than one NUMA node, the arenas are split into one set per node, and every mapping
+ * an arena makes asks for memory of its node with mbind(MPOL_PREFERRED), so it falls back to other nodes
+ * rather than failing. A thread takes an arena of the node it runs on when it is assigned one, and stays with
+ * it if it migrates later. Remote frees always go back to the arena, and so the node, that owns the block.
+ * PB_NUMA=0 turns this off.
+ */
+#define MAX_ARENAS 64
+#define MAX_NODES  64            //nodes we keep apart, as bits of one mbind() node mask
+
+typedef struct arena {
+  pthread_mutex_t lock;
+  link_s*  free_ptr;                                 //head of the first-fit list, or root of the best-fit tree
+#if !defined (PB_FIRST_FIT)
+  link_s*  size_class_heads[NUM_SIZE_CLASSES];       //heads of the per-class lists
+  uint64_t size_class_map;                           //bit i is set when size_class_heads[i] is non-empty
+#endif
+#if defined (PB_TLSF)
+  link_s*  tlsf_heads[TLSF_FL_COUNT][TLSF_SL_COUNT]; //heads of the TLSF bins
+  uint32_t tlsf_sl_map[TLSF_FL_COUNT];               //bit j of word i is set when tlsf_heads[i][j] is non-empty
+  uint64_t tlsf_fl_map;                              //bit i is set when tlsf_sl_map[i] is non-zero
+#endif
+  segment_s* segments;                               //every block segment of this arena, newest first
+  segment_s* segment;                                //segment that holds the bump region
+  segment_s* slab_segments;                          //every slab segment of this arena, newest first
+  struct slab* slab_partial[SLAB_CLASSES];           //slabs with free objects, per size class
+  void*    remote_free;                              //blocks freed by threads of other arenas
+  void*    remote_pending;                           //blocks taken off remote_free but not freed yet
+  size_t   dirty;                                    //bytes freed since the last purge
+  uint64_t searches;                                 //fit searches of the free lists
+  uint64_t search_steps;                             //free blocks looked at by fit searches
+  uint64_t last_purge;                               //CLOCK_MONOTONIC time of the last purge, in ns
+  unsigned node;                                     //NUMA node the arena's memory comes from
+
+} arena_s;
+
+#define ARENA_HEADER_SIZE ((sizeof(arena_s) + 63) & ~(size_t)63)
+
+//largest block that fits in a segment next to both headers and the room for a header after it
+#define SEGMENT_MAX_BLOCK (SEGMENT_SIZE - SEGMENT_HEADER_SIZE - ARENA_HEADER_SIZE - 2 * BLOCK_OVERHEAD)
+
+static arena_s*        arenas[MAX_ARENAS];
+static unsigned        num_arenas;
+static unsigned        num_nodes = 1;             //NUMA nodes with arenas of their own
+static unsigned        node_arenas;               //arenas per node; node n has arenas n * node_arenas on
+static unsigned char   node_ids[MAX_NODES];       //kernel number of each node, node n is node_ids[n]
+static unsigned        next_arena[MAX_NODES];
+static unsigned        arenas_wanted;             //arenas the narenas option asks for, 0 for one per CPU
+static int             numa_wanted = 1;           //cleared by the numa option or PB_NUMA=0
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+//returns the segment that holds the block at (ptr)
+static inline segment_s* segment_of (void* ptr) {
+  return (segment_s*) ((intptr_t) ptr & ~(intptr_t)(SEGMENT_SIZE - 1));
+}
+
+//returns the arena that owns the block at (ptr)
+static inline arena_s* arena_of (void* ptr) {
+  return segment_of(ptr) -> arena;
+}
+
+
+//reads the online NUMA nodes from the ranges in /sys/devices/system/node/online (such as 0-1,4) into node_ids and
+//returns how many there are. Nodes numbered MAX_NODES and up are left out, as no node mask can name them.
+static unsigned numa_nodes () {
+
+  char    buffer[256];
+  int     fd     = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+  ssize_t length = fd < 0 ? -1 : read(fd, buffer, sizeof(buffer) - 1);
+  if (fd >= 0) {
+    close(fd);
+  }
+  buffer[length > 0 ? length : 0] = '\0';
+
+  unsigned count = 0;
+  char*    next  = buffer;
+  while (*next >= '0' && *next <= '9') {
+    unsigned long first = strtoul(next, &next, 10);
+    unsigned long last  = *next == '-' ? strtoul(next + 1, &next, 10) : first;
+    for (unsigned long node = first; node <= last && node < MAX_NODES; node += 1) {
+      node_ids[count++] = (unsigned char) node;
+    }
+    next += *next == ',';
+  }
+  return count;
+}
+
+//asks for the pages of the (length) bytes at (map) to come from NUMA node (node)
+static void numa_bind (void* map, size_t length, unsigned node) {
+  if (num_nodes > 1) {
+    unsigned long mask = 1ul << node;
+    syscall(SYS_mbind, map, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+  }
+}
+
+//returns the index in node_ids of the NUMA node the calling thread runs on
+static unsigned numa_node () {
+  unsigned node = 0;
+  if (num_nodes > 1 && getcpu(NULL, &node) == 0) {
+    for (unsigned i = 0; i < num_nodes; i += 1) {
+      if (node_ids[i] == node) {
+        return i;
+      }
+    }
+  }
+  return 0;
+}
+
+
+static void conf_read (const char* conf);
+
+/* init() decides how many arenas the heap uses, how they are spread over NUMA nodes and which placement
+ * policy they follow. It runs once, under arenas_lock. The options of PB_MALLOC_CONF are read first (see
+ * Configuration), so the older single variables such as PB_FIT and PB_HUGEPAGES override them. Setting
+ * PB_VERBOSE to anything but 0 reports the arena layout on stderr; nothing is ever written to stdout.
+ */
+static void init () {
+
+  if (num_arenas == 0) {
+    conf_read(getenv("PB_MALLOC_CONF"));
+
+    long        cpus = arenas_wanted != 0 ? (long) arenas_wanted : sysconf(_SC_NPROCESSORS_ONLN);
+    const char* numa = getenv("PB_NUMA");
+
+    if (numa_wanted && (numa == NULL || strcmp(numa, "0") != 0)) {
+      unsigned nodes = numa_nodes();
+      num_nodes = nodes < 1 ? 1 : nodes > MAX_NODES ? MAX_NODES : nodes;
+    }
+    cpus        = cpus < 1 ? 1 : cpus;
+    node_arenas = (cpus + num_nodes - 1) / num_nodes;
+    node_arenas = node_arenas > MAX_ARENAS / num_nodes ? MAX_ARENAS / num_nodes : node_arenas;
+    num_arenas  = node_arenas * num_nodes;
+
+#if defined (PB_HARDEN)
+    const uintptr_t* random = (const uintptr_t*) getauxval(AT_RANDOM);
+    harden_key = random != NULL ? random[1] : (uintptr_t) &random ^ (uintptr_t) time(NULL) << 20;
+#endif
+
+    const char* fit = getenv("PB_FIT");
+    if (fit != NULL && strcmp(fit, "best") == 0) {
+      fit_policy = FIT_BEST;
+    }
+
+    const char* sample = getenv("PB_PROF_SAMPLE");
+    if (sample != NULL) {
+      prof_interval = strtoull(sample, NULL, 10);
+    }
+
+    const char* stats = getenv("PB_STATS");
+    stats_at_exit = stats != NULL && *stats != '\0' && strcmp(stats, "0") != 0;
+
+    const char* huge = getenv("PB_HUGEPAGES");
+    if (huge != NULL && SEGMENT_SIZE % HUGE_PAGE_SIZE == 0) {
+      huge_pages = strcmp(huge, "hugetlb") == 0 ? HUGE_TLB : strcmp(huge, "thp") == 0 ? HUGE_THP : HUGE_OFF;
+    }
+
+    const char* trace = getenv("PB_TRACE");
+    if (trace != NULL && *trace != '\0') {
+      int fd = open(trace, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      pb_trace_header_s header = { .event_size = sizeof(pb_trace_event_s) };
+      memcpy(header.magic, PB_TRACE_MAGIC, sizeof(header.magic));
+      if (fd >= 0 && write(fd, &header, sizeof(header)) == sizeof(header)) {
+        trace_fd = fd;
+      }
+    }
+
+    const char* verbose = getenv("PB_VERBOSE");
+    if (verbose != NULL && *verbose != '\0' && strcmp(verbose, "0") != 0) {
+      fd_printf(STDERR_FILENO, "pb-alloc: %u arenas on %u nodes, %s fit\n", num_arenas, num_nodes,
+                fit_policy == FIT_BEST ? "best" : "first");
+    }
+  }
+
+}
+
+
+/* segment_map() maps (size) bytes of new memory aligned to SEGMENT_SIZE. It returns NULL, with errno set to
+ * ENOMEM, when the system is out of memory. 
+ *
+ * The call to mmap() maps a virtual address space to physical memory.
+ *   
+ *   We set the len variable to (size) plus SEGMENT_SIZE, so that the mapping contains a SEGMENT_SIZE-aligned
+ *   region, and unmap the unaligned head and tail afterwards.
+ *   We set the prot parameter so that we can read and write data. 
+ *   We include MAP_PRIVATE and MAP_ANONYMOUS flags. MAP_PRIVATE abstracts changes in the mapped data. 
+ *   MAP_ANONYMOUS ignores the next parameter, 'fildes'. This means we create a new zeroed region of memory for each call. 
+ *
+ * When (page_size) is not NULL, the mapping may come from the hugetlbfs pool, and the page size it got is stored
+ * there. With huge pages on, the mapping gets the THP hint otherwise.
+ */
+static void* segment_map (size_t size, size_t* page_size) {
+
+  int   huge    = __atomic_load_n(&huge_pages, __ATOMIC_RELAXED);
+  int   hugetlb = huge == HUGE_TLB && page_size != NULL && size % HUGE_PAGE_SIZE == 0;
+  void* map     = mmap(NULL, size + SEGMENT_SIZE, hugetlb ? PROT_NONE : PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | (hugetlb ? MAP_NORESERVE : 0), -1, 0);
+  if (map == MAP_FAILED) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  intptr_t base = ((intptr_t) map + SEGMENT_SIZE - 1) & ~(intptr_t)(SEGMENT_SIZE - 1);
+
+  //a hugetlb mapping goes into the aligned part of the reservation, or the reservation becomes ordinary memory
+  if (hugetlb && mmap((void*) base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) == MAP_FAILED) {
+    hugetlb = 0;
+    if (mmap((void*) base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      munmap(map, size + SEGMENT_SIZE);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+  if (base != (intptr_t) map) {
+    munmap(map, base - (intptr_t) map);
+  }
+  munmap((void*) (base + size), (intptr_t) map + SEGMENT_SIZE - base);
+
+  if (huge != HUGE_OFF && !hugetlb && size >= HUGE_PAGE_SIZE) {
+    madvise((void*) base, size, MADV_HUGEPAGE);
+  }
+  if (page_size != NULL) {
+    *page_size = huge != HUGE_OFF && size % HUGE_PAGE_SIZE == 0 ? HUGE_PAGE_SIZE : PAGE_SIZE;
+  }
+
+  return (void*) base;
+}
+
+
+/* segment_create() maps a new segment of (size) bytes and (kind) for (arena), on NUMA node (node). If the mapping
+ * is successful, we delimit the start and end of the segment in our address space. 
+ */
+static segment_s* segment_create (arena_s* arena, unsigned node, size_t size, unsigned long kind) {
+
+  size_t     page_size;
+  segment_s* segment = (segment_s*) segment_map(size, &page_size);
+  if (segment == NULL) {
+    return NULL;
+  }
+  numa_bind(segment, size, node);
+
+  intptr_t base = (intptr_t) segment;
+  segment -> page_size = page_size;
+  segment -> arena     = arena;
+  segment -> kind      = kind;
+  segment -> size      = size;
+  segment -> start_ptr = base + SEGMENT_HEADER_SIZE;
+  segment -> end_ptr   = base + size - (kind == SEGMENT_BLOCKS ? BLOCK_OVERHEAD : 0);
+  segment -> last_unallocated_free_ptr = (void*) segment -> start_ptr;
+  segment -> high_water = segment -> last_unallocated_free_ptr;
+
+  return segment;
+}
+
+
+//returns the CLOCK_MONOTONIC time in ns
+static inline uint64_t now_ns () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* arena_create() sets up a new arena in a fresh segment. The arena_s takes the space right after the
+ * segment header, and the rest of the segment is the arena's first bump region.
+ */
+static arena_s* arena_create (unsigned node) {
+
+  segment_s* segment = segment_create(NULL, node, SEGMENT_SIZE, SEGMENT_BLOCKS);
+  if (segment == NULL) {
+    return NULL;
+  }
+
+  arena_s* arena = (arena_s*) segment -> start_ptr;
+  pthread_mutex_init(&arena -> lock, NULL);
+  arena -> segments  = segment;
+  arena -> segment   = segment;
+  arena -> last_purge = now_ns();
+  arena -> node       = node;
+
+  segment -> arena     = arena;
+  segment -> start_ptr = segment -> start_ptr + ARENA_HEADER_SIZE;
+  segment -> last_unallocated_free_ptr = (void*) segment -> start_ptr;
+  segment -> high_water = segment -> last_unallocated_free_ptr;
+
+  return arena;
+}
+
+
+//returns the index of the size class that serves a request of (size) bytes
+static inline size_t size_class (size_t size) {
+  return size == 0 ? 0 : (size - 1) / ALIGNMENT;
+}
+
+//rounds (size) up to a multiple of ALIGNMENT, so that every header, payload and tag stays aligned. Sizes
+//within ALIGNMENT of SIZE_MAX wrap around to 0, which malloc() turns away on its slow path.
+static inline size_t align_size (size_t size) {
+  return (size + ALIGNMENT - 1 + (size == 0)) & ~(size_t)(ALIGNMENT - 1);
+}
+
+
+//helpers for walking the heap physically. block_after() is only valid below the bump frontier,
+//block_before() only while block_prev_free() is not 0.
+static inline void*   block_payload (link_s* block) { return (void*) ((intptr_t) block + BLOCK_OVERHEAD); }
+static inline link_s* block_header  (void* ptr)     { return (link_s*) ((intptr_t) ptr - BLOCK_OVERHEAD); }
+static inline link_s* block_after   (link_s* block) { return (link_s*) ((intptr_t) block_payload(block) + block -> size); }
+static inline size_t  block_flags   (link_s* block) { return block -> tag & BLOCK_FLAGS; }
+
+//returns the size of the block physically before (block) if it is free, and 0 if it is in use or there is none
+static inline size_t block_prev_free (link_s* block) {
+  return block -> tag & ~(size_t) BLOCK_FLAGS;
+}
+
+static inline link_s* block_before (link_s* block) {
+  return (link_s*) ((intptr_t) block - block_prev_free(block) - BLOCK_OVERHEAD);
+}
+
+//returns what the canary of a block of (size) bytes at (block) must hold
+#if defined (PB_HARDEN)
+static inline size_t block_canary (link_s* block, size_t size) {
+  return (uintptr_t) block ^ size ^ harden_key;
+}
+#endif
+
+//writes the header of a block and the tag of the block after it
+static inline void set_block (link_s* block, size_t size, size_t flags) {
+#if defined (PB_HARDEN)
+  block -> canary = block_canary(block, size);
+#endif
+  block -> size = size;
+  block -> tag  = (block -> tag & ~(size_t) BLOCK_FLAGS) | flags;
+  link_s* next = block_after(block);
+  next -> tag   = (next -> tag & BLOCK_FLAGS) | (flags == 0 ? size : 0);
+}
+
+//changes the flags of a block, leaving its size and the tag after it alone
+static inline void set_block_flags (link_s* block, size_t flags) {
+  block -> tag = (block -> tag & ~(size_t) BLOCK_FLAGS) | flags;
+}
+
+
+/*
+ * Best-fit tree. With the best-fit policy, free_ptr is the root of a treap of free blocks instead of the
+ * head of a list, reusing link_s -> next and prev as the left and right children. Blocks are ordered by size
+ * and then by address, so a lookup finds the smallest block that fits, and the lowest such block in memory,
+ * in O(log n) expected time. A block's heap priority is a hash of its address, which keeps the tree balanced
+ * without storing anything else in the block.
+ */
+#define tree_left(block)  ((block) -> next)
+#define tree_right(block) ((block) -> prev)
+
+//returns 1 if (a) sorts before (b)
+static inline int tree_before (link_s* a, link_s* b) {
+  return a -> size < b -> size || (a -> size == b -> size && a < b);
+}
+
+//returns the treap priority of (block)
+static inline uint64_t tree_priority (link_s* block) {
+  return ((uint64_t)(intptr_t) block >> 4) * 0x9E3779B97F4A7C15ull;
+}
+
+//splits the tree at (root) into the blocks that sort before (key), stored at (left), and the rest, at (right)
+static void tree_split (link_s* root, link_s* key, link_s** left, link_s** right) {
+
+  while (root != NULL) {
+    if (tree_before(root, key)) {
+      *left = root;
+      left  = &tree_right(root);
+      root  = tree_right(root);
+    } else {
+      *right = root;
+      right  = &tree_left(root);
+      root   = tree_left(root);
+    }
+  }
+  *left  = NULL;
+  *right = NULL;
+}
+
+//joins the trees at (left) and (right), where every block in (left) sorts before every block in (right)
+static link_s* tree_merge (link_s* left, link_s* right) {
+
+  link_s*  root;
+  link_s** link = &root;
+
+  while (left != NULL && right != NULL) {
+    if (tree_priority(left) > tree_priority(right)) {
+      *link = left;
+      link  = &tree_right(left);
+      left  = tree_right(left);
+    } else {
+      *link = right;
+      link  = &tree_left(right);
+      right = tree_left(right);
+    }
+  }
+  *link = left != NULL ? left : right;
+
+  return root;
+}
+
+//adds a free block to the tree at (root)
+static void tree_insert (link_s** root, link_s* block) {
+
+  link_s** link = root;
+  while (*link != NULL && tree_priority(*link) > tree_priority(block)) {
+    link = tree_before(block, *link) ? &tree_left(*link) : &tree_right(*link);
+  }
+
+  tree_split(*link, block, &tree_left(block), &tree_right(block));
+  *link = block;
+}
+
+//removes a free block from the tree at (root)
+static void tree_remove (link_s** root, link_s* block) {
+
+  link_s** link = root;
+  while (*link != block) {
+    link = tree_before(block, *link) ? &tree_left(*link) : &tree_right(*link);
+  }
+
+  *link = tree_merge(tree_left(block), tree_right(block));
+}
+
+#if !defined (PB_TLSF)
+//returns the smallest free block of atleast (size) bytes in the best-fit tree of (arena), or NULL
+static link_s* tree_best_fit (arena_s* arena, size_t size) {
+
+  link_s* root = arena -> free_ptr;
+  link_s* best = NULL;
+  while (root != NULL) {
+    arena -> search_steps += 1;
+    if (root -> size >= size) {
+      best = root;
+      root = tree_left(root);
+    } else {
+      root = tree_right(root);
+    }
+  }
+
+  return best;
+}
+#endif
+
+
+#if defined (PB_TLSF)
+//returns 1 if free blocks of (size) bytes go on the exact-size class lists rather than in the TLSF bins
+static inline int in_size_classes (size_t size) {
+#if defined (PB_FIRST_FIT)
+  return 0;
+#else
+  return size <= SMALL_MAX;
+#endif
+}
+
+//stores the first- and second-level bin of a free block of (size) bytes
+static inline void tlsf_mapping (size_t size, unsigned* fl, unsigned* sl) {
+
+  if (size < TLSF_SMALL) {
+    *fl = 0;
+    *sl = size / (TLSF_SMALL / TLSF_SL_COUNT);
+    return;
+  }
+
+  unsigned msb = 63 - __builtin_clzll(size);
+  *fl = msb - TLSF_FL_SHIFT + 1;
+  *sl = (size >> (msb - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+}
+
+//marks the bin of a free block of (size) bytes as non-empty
+static inline void tlsf_mark (arena_s* arena, size_t size) {
+
+  unsigned fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+  arena -> tlsf_sl_map[fl] |= 1u << sl;
+  arena -> tlsf_fl_map     |= (uint64_t)1 << fl;
+}
+
+//marks the bin of a free block of (size) bytes as empty
+static inline void tlsf_unmark (arena_s* arena, size_t size) {
+
+  unsigned fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+  arena -> tlsf_sl_map[fl] &= ~(1u << sl);
+  if (arena -> tlsf_sl_map[fl] == 0) {
+    arena -> tlsf_fl_map &= ~((uint64_t)1 << fl);
+  }
+}
+
+//returns a free block of atleast (size) bytes from the first non-empty bin that only holds such blocks, or NULL
+static link_s* tlsf_find (arena_s* arena, size_t size) {
+
+  if (size >= TLSF_SMALL) {
+    size += ((size_t)1 << (63 - __builtin_clzll(size) - TLSF_SL_LOG2)) - 1;
+  }
+
+  unsigned fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+
+  uint32_t sl_map = arena -> tlsf_sl_map[fl] & (~0u << sl);
+  if (sl_map == 0) {
+    uint64_t fl_map = fl + 1 < TLSF_FL_COUNT ? arena -> tlsf_fl_map & (~(uint64_t)0 << (fl + 1)) : 0;
+    if (fl_map == 0) {
+      return NULL;
+    }
+    fl     = __builtin_ctzll(fl_map);
+    sl_map = arena -> tlsf_sl_map[fl];
+  }
+
+  return arena -> tlsf_heads[fl][__builtin_ctz(sl_map)];
+}
+#endif
+
+
+//returns the head of the free list that a free block of (size) bytes belongs on
+static inline link_s** free_list_for (arena_s* arena, size_t size) {
+#if !defined (PB_FIRST_FIT)
+  if (size <= SMALL_MAX) {
+    return &arena -> size_class_heads[size_class(size)];
+  }
+#endif
+#if defined (PB_TLSF)
+  unsigned fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+  return &arena -> tlsf_heads[fl][sl];
+#else
+  return &arena -> free_ptr;
+#endif
+}
+
+//pushes a free block onto the front of its free list
+static void free_list_insert (arena_s* arena, link_s* block) {
+
+  link_s** head = free_list_for(arena, block -> size);
+
+  if (head == &arena -> free_ptr && fit_policy == FIT_BEST) {
+    tree_insert(head, block);
+    return;
+  }
+
+  block -> prev = NULL;
+  block -> next = *head;
+  if (*head != NULL) {
+    (*head) -> prev = block;
+  }
+  *head = block;
+
+#if !defined (PB_FIRST_FIT)
+  if (block -> size <= SMALL_MAX) {
+    arena -> size_class_map |= (uint64_t)1 << size_class(block -> size);
+  }
+#endif
+#if defined (PB_TLSF)
+  if (!in_size_classes(block -> size)) {
+    tlsf_mark(arena, block -> size);
+  }
+#endif
+}
+
+//unlinks a free block from anywhere in its free list
+static void free_list_remove (arena_s* arena, link_s* block) {
+
+  link_s** head = free_list_for(arena, block -> size);
+
+  if (head == &arena -> free_ptr && fit_policy == FIT_BEST) {
+    tree_remove(head, block);
+    return;
+  }
+
+#if defined (PB_HARDEN)
+  if ((block -> prev == NULL ? *head != block : block -> prev -> next != block) || (block -> next != NULL && block -> next -> prev != block)) {
+    harden_fail("corrupted free list", block_payload(block));
+  }
+#endif
+
+  if (block -> prev == NULL) {
+    *head = block -> next;
+  } else {
+    block -> prev -> next = block -> next;
+  }
+  if (block -> next != NULL) {
+    block -> next -> prev = block -> prev;
+  }
+
+#if !defined (PB_FIRST_FIT)
+  if (*head == NULL && block -> size <= SMALL_MAX) {
+    arena -> size_class_map &= ~((uint64_t)1 << size_class(block -> size));
+  }
+#endif
+#if defined (PB_TLSF)
+  if (*head == NULL && !in_size_classes(block -> size)) {
+    tlsf_unmark(arena, block -> size);
+  }
+#endif
+}
+
+
+//marks a free block as allocated for a request of (size) bytes. If the rest of the block is at least
+//MIN_SPLIT bytes, it is split off and put back on a free list.
+static void* use_block (arena_s* arena, link_s* block, size_t size) {
+
+  if (block -> size >= size + BLOCK_OVERHEAD + MIN_SPLIT) {
+    size_t  remainder = block -> size - size - BLOCK_OVERHEAD;
+    set_block(block, size, BLOCK_IN_USE);
+
+    link_s* rest = block_after(block);
+    set_block(rest, remainder, 0);
+    free_list_insert(arena, rest);
+  } else {
+    set_block(block, block -> size, BLOCK_IN_USE);
+  }
+
+  return block_payload(block);
+}
+
+
+//maps a new segment for (arena) and makes it the bump region. Whatever is left of the old bump region
+//becomes a free block, if it is big enough to hold one.
+static segment_s* arena_grow (arena_s* arena) {
+
+  segment_s* segment = segment_create(arena, arena -> node, SEGMENT_SIZE, SEGMENT_BLOCKS);
+  if (segment == NULL) {
+    return NULL;
+  }
+
+  segment_s* old  = arena -> segment;
+  size_t     tail = old -> end_ptr - (intptr_t) old -> last_unallocated_free_ptr;
+  if (tail >= BLOCK_OVERHEAD + MIN_SPLIT) {
+    link_s* block = (link_s*) old -> last_unallocated_free_ptr;
+    set_block(block, tail - BLOCK_OVERHEAD, 0);
+    free_list_insert(arena, block);
+    old -> last_unallocated_free_ptr = (void*) old -> end_ptr;
+  }
+
+  segment -> next   = arena -> segments;
+  arena -> segments = segment;
+  arena -> segment  = segment;
+
+  return segment;
+}
+
+
+//raises the high_water mark of (segment) past its bump frontier and the tag written there
+static inline void bump_high_water (segment_s* segment) {
+  void* written = (void*) ((intptr_t) segment -> last_unallocated_free_ptr + BLOCK_OVERHEAD);
+  if (written > segment -> high_water) {
+    segment -> high_water = written;
+  }
+}
+
+//carves a new block of (size) bytes at the bump frontier, between the last allocated block and the end of the
+//current segment. A new segment is mapped when this one is full. Memory above the segment's high_water mark has
+//never been written since it was mapped or purged, so if (stale) is not NULL we store how many leading bytes
+//of the payload may not be zero.
+static void* bump_alloc (arena_s* arena, size_t size, size_t* stale) {
+
+  segment_s* segment = arena -> segment;
+
+  if ((intptr_t) segment -> last_unallocated_free_ptr + BLOCK_OVERHEAD + size > segment -> end_ptr) {
+    segment = arena_grow(arena);
+    if (segment == NULL) {
+      return NULL;
+    }
+  }
+
+  link_s* block = (link_s*) segment -> last_unallocated_free_ptr; 
+  set_block(block, size, BLOCK_IN_USE);
+
+  if (stale != NULL) {
+    intptr_t written = (intptr_t) segment -> high_water - (intptr_t) block_payload(block);
+    *stale = written <= 0 ? 0 : (size_t) written < size ? (size_t) written : size;
+  }
+
+  segment -> last_unallocated_free_ptr = (void*) block_after(block); 
+  bump_high_water(segment);
+  
+  return block_payload(block);  
+}
+
+
+static size_t large_count;      //live large mappings
+static size_t large_bytes;      //bytes in live large mappings
+
+//returns the length of a large mapping that holds a block of (size) bytes whose header starts (offset) bytes
+//into the mapping
+static inline size_t large_length (size_t offset, size_t size) {
+  return (offset + BLOCK_OVERHEAD + size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+//returns where the block header goes in a large mapping so the payload is aligned to (alignment). Mappings are
+//SEGMENT_SIZE-aligned, so this works for any alignment below SEGMENT_SIZE.
+static inline size_t large_offset (size_t alignment) {
+  return ((SEGMENT_HEADER_SIZE + BLOCK_OVERHEAD + alignment - 1) & ~(alignment - 1)) - BLOCK_OVERHEAD;
+}
+
+//writes the segment header and the single block of a large mapping of (length) bytes at (map), with the block
+//header (offset) bytes in. The block gets the rest of the mapping, so realloc() can grow into the slack of the
+//last page for free.
+static void* large_init (void* map, size_t length, size_t offset, arena_s* arena) {
+
+  segment_s* segment = (segment_s*) map;
+  segment -> arena     = arena;
+  segment -> kind      = SEGMENT_LARGE;
+  segment -> size      = length;
+  segment -> page_size = PAGE_SIZE;
+  segment -> start_ptr = (intptr_t) map + offset;
+  segment -> end_ptr   = (intptr_t) map + length;
+
+  link_s* block = (link_s*) segment -> start_ptr;
+  block -> tag  = BLOCK_MAPPED;
+  block -> size = length - offset - BLOCK_OVERHEAD;
+#if defined (PB_HARDEN)
+  block -> canary = block_canary(block, block -> size);
+#endif
+  segment -> last_unallocated_free_ptr = (void*) block_after(block);
+
+  return block_payload(block);
+}
+
+//maps a large block of (size) bytes aligned to (alignment), owned by (arena), or by none for an internal
+//allocation (see Reentrancy below). No lock is needed. The pages
+//skipped to align the block are never touched, so they cost address space only.
+static void* large_alloc (arena_s* arena, size_t size, size_t alignment) {
+
+  if (size > SIZE_MAX / 2) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t offset = large_offset(alignment);
+  size_t length = large_length(offset, size);
+  void*  map    = segment_map(length, NULL);
+  if (map == NULL) {
+    return NULL;
+  }
+  if (arena != NULL) {
+    numa_bind(map, length, arena -> node);
+  }
+
+  __atomic_add_fetch(&large_count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&large_bytes, length, __ATOMIC_RELAXED);
+  return large_init(map, length, offset, arena);
+}
+
+//unmaps the large mapping (segment)
+static void large_free (segment_s* segment) {
+  __atomic_sub_fetch(&large_count, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&large_bytes, segment -> size, __ATOMIC_RELAXED);
+  munmap(segment, segment -> size);
+}
+
+//resizes the large mapping (segment) to hold (size) bytes with mremap(). It is resized in place when possible
+//and moved onto a new aligned reservation otherwise, keeping the block at the same offset. Returns NULL on
+//failure, in which case the block is left as it was.
+static void* large_realloc (segment_s* segment, size_t size) {
+
+  size_t offset = segment -> start_ptr - (intptr_t) segment;
+  size_t length = large_length(offset, size);
+
+  if (length == segment -> size) {
+    return (void*) (segment -> start_ptr + BLOCK_OVERHEAD);
+  }
+
+  void* map = mremap(segment, segment -> size, length, 0);
+  if (map == MAP_FAILED) {
+    void* fresh = segment_map(length, NULL);
+    if (fresh == NULL) {
+      return NULL;
+    }
+    map = mremap(segment, segment -> size, length, MREMAP_MAYMOVE | MREMAP_FIXED, fresh);
+    if (map == MAP_FAILED) {
+      munmap(fresh, length);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+  __atomic_add_fetch(&large_bytes, length - ((segment_s*) map) -> size, __ATOMIC_RELAXED);
+  return large_init(map, length, offset, ((segment_s*) map) -> arena);
+}
+
+
+#if !defined (PB_TLSF)
+//find the first fit block by looping through the first-fit list
+static link_s* first_fit (arena_s* arena, size_t size) {
+
+  link_s* free_block_header = arena -> free_ptr;
+ 
+  while (free_block_header != NULL) {
+    arena -> search_steps += 1;
+    if (size <= free_block_header -> size) {
+      return free_block_header;
+    }
+    free_block_header = free_block_header -> next; 
+  }
+
+  return NULL;
+}
+#endif
+
+
+/*
+ * heap_alloc allocates a block of atleast (size) bytes from (arena). The caller holds the arena's lock
+ * and has already rounded (size) with align_size().
+ *
+ * Small requests take the head of the smallest non-empty size class that fits, found with one bit scan
+ * of size_class_map. Everything else, and every request in PB_FIRST_FIT mode, scans the first-fit list,
+ * searches the best-fit tree or, in PB_TLSF mode, takes the head of the first TLSF bin that fits.
+ * Oversized free blocks are split. If no freed block fits we bump-allocate. Returns NULL when the
+ * arena cannot grow.
+ *
+ * If (stale) is not NULL we store how many leading bytes of the new block may not be zero, which is all of
+ * it unless it came from fresh memory at the bump frontier.
+ */
+static void* heap_alloc (arena_s* arena, size_t size, size_t* stale) {
+
+  link_s* free_block_header;
+
+#if !defined (PB_FIRST_FIT)
+  if (size <= SMALL_MAX) {
+    uint64_t candidates = arena -> size_class_map & (~(uint64_t)0 << size_class(size));
+
+    if (candidates != 0) {
+      free_block_header = arena -> size_class_heads[__builtin_ctzll(candidates)];
+      link_s* next      = free_block_header -> next;
+      free_list_remove(arena, free_block_header);
+      if (next != NULL) {
+        __builtin_prefetch(next -> next, 1);         //the block the next pop of this class will update
+      }
+      if (stale != NULL) {
+        *stale = size;
+      }
+      return use_block(arena, free_block_header, size);
+    }
+  }
+#endif
+
+  arena -> searches += 1;
+#if defined (PB_TLSF)
+  free_block_header = tlsf_find(arena, size);
+#else
+  free_block_header = fit_policy == FIT_BEST ? tree_best_fit(arena, size) : first_fit(arena, size);
+#endif
+  if (free_block_header != NULL) {
+    free_list_remove(arena, free_block_header);
+    if (stale != NULL) {
+      *stale = size;
+    }
+    return use_block(arena, free_block_header, size);
+  }
+
+  //None of the blocks made with free() are large enough for allocation. So we allocate
+  //in the space between the last allocated block and the end of the heap.
+  return bump_alloc(arena, size, stale);
+
+} // heap_alloc()
+
+
+//heap_free gives an allocated block back to its arena. The caller holds the arena's lock. We mark it as free
+//and merge it with the free blocks physically next to it. A block that ends at the bump frontier is given
+//back to the bump region, anything else goes to the start of the free list for its size.
+static void heap_free (arena_s* arena, link_s* block) {
+ 
+  segment_s* segment = segment_of(block);
+  size_t     size    = block -> size;
+
+#if defined (PB_HARDEN)
+  if (block_flags(block) != BLOCK_IN_USE) {
+    harden_fail("double free", block_payload(block));
+  }
+#endif
+  arena -> dirty += size;
+
+  link_s* next = block_after(block);
+  if ((void*) next != segment -> last_unallocated_free_ptr && block_flags(next) == 0) {
+    free_list_remove(arena, next);
+    size += BLOCK_OVERHEAD + next -> size;
+  }
+
+  if (block_prev_free(block)) {
+    link_s* prev = block_before(block);
+    free_list_remove(arena, prev);
+    size += BLOCK_OVERHEAD + prev -> size;
+    block = prev;
+  }
+
+  set_block(block, size, 0);
+
+  if ((void*) block_after(block) == segment -> last_unallocated_free_ptr && segment == arena -> segment) {
+    segment -> last_unallocated_free_ptr = block;
+    return;
+  }
+
+  free_list_insert(arena, block);
+   
+} // heap_free()
+
+
+/*
+ * heap_resize tries to resize an allocated block to (size) bytes without moving it. The caller holds the arena's
+ * lock and has already rounded (size) with align_size(). Returns 1 on success and 0 if the block has to move.
+ *
+ * Shrinking splits off the tail, if it is big enough to be a block, and frees it, so it merges with whatever
+ * free block follows. Growing takes space from the free block physically after this one, or moves the bump
+ * frontier if this block is the last one before it, splitting off whatever is not needed.
+ */
+static int heap_resize (arena_s* arena, link_s* block, size_t size) {
+
+  segment_s* segment = segment_of(block);
+
+  if (size <= block -> size) {
+    if (block -> size >= size + BLOCK_OVERHEAD + MIN_SPLIT) {
+      size_t remainder = block -> size - size - BLOCK_OVERHEAD;
+      set_block(block, size, BLOCK_IN_USE);
+
+      link_s* rest = block_after(block);
+      set_block(rest, remainder, BLOCK_IN_USE);
+      heap_free(arena, rest);
+    }
+    return 1;
+  }
+
+  link_s* next = block_after(block);
+
+  if ((void*) next == segment -> last_unallocated_free_ptr) {
+    if (segment != arena -> segment || (intptr_t) block_payload(block) + size > segment -> end_ptr) {
+      return 0;
+    }
+    set_block(block, size, BLOCK_IN_USE);
+    segment -> last_unallocated_free_ptr = (void*) block_after(block);
+    bump_high_water(segment);
+    return 1;
+  }
+
+  if (block_flags(next) != 0 || block -> size + BLOCK_OVERHEAD + next -> size < size) {
+    return 0;
+  }
+
+  free_list_remove(arena, next);
+  block -> size += BLOCK_OVERHEAD + next -> size;
+  use_block(arena, block, size);
+  return 1;
+
+} // heap_resize()
+
+
+/*
+ * heap_alloc_aligned allocates a block of atleast (size) bytes from (arena) whose payload is aligned to
+ * (alignment), a power of two above ALIGNMENT. The caller holds the arena's lock and has already rounded
+ * (size) with align_size().
+ *
+ * We take a block big enough to hold an aligned payload after a leading block of its own, then carve it: the
+ * space in front of the aligned payload becomes a free block, which merges with whatever is free before it,
+ * and heap_resize() splits off and frees the tail. Nothing but the headers is lost to the alignment.
+ */
+static void* heap_alloc_aligned (arena_s* arena, size_t size, size_t alignment) {
+
+  void* ptr = heap_alloc(arena, size + alignment + BLOCK_OVERHEAD + MIN_SPLIT, NULL);
+  if (ptr == NULL) {
+    return NULL;
+  }
+
+  link_s* block = block_header(ptr);
+
+  if (((intptr_t) ptr & (alignment - 1)) != 0) {
+    intptr_t aligned = ((intptr_t) ptr + BLOCK_OVERHEAD + MIN_SPLIT + alignment - 1) & ~(intptr_t)(alignment - 1);
+    size_t   lead    = aligned - (intptr_t) ptr;
+    size_t   rest    = block -> size - lead;
+
+    set_block(block, lead - BLOCK_OVERHEAD, BLOCK_IN_USE);
+    link_s* aligned_block = block_after(block);
+    set_block(aligned_block, rest, BLOCK_IN_USE);
+
+    heap_free(arena, block);
+    block = aligned_block;
+  }
+
+  heap_resize(arena, block, size);
+  return block_payload(block);
+
+} // heap_alloc_aligned()
+
+
+/*
+ * Slabs. Objects of up to SLAB_MAX bytes do not get a link_s header at all. They are packed into slabs of
+ * SLAB_SIZE bytes, one size class per slab, which are cut from segments of kind SEGMENT_SLABS. A slab starts
+ * with a slab_s header holding an occupancy bitmap with one bit per object, and free() finds that header by
+ * masking the object's address. Slabs that still have free objects are kept on a partial list per size class.
+ *
+ * An emptied slab goes back to its segment unless it is the last partial slab of its class. Each slab segment
+ * tracks its empty slabs in free_map, and the ones not yet purged in dirty_map, both stored right after the
+ * segment header.
+ */
+#define SLAB_SIZE        4096
+#define SLAB_HEADER_SIZE 64
+#define SLAB_MAP_WORDS   ((SLAB_SIZE / ALIGNMENT + 63) / 64)
+
+typedef struct slab {
+  struct slab* next;                         //partial list of the same size class
+  struct slab* prev;
+  uint16_t size_class;
+  uint16_t count;                            //objects in use
+  uint16_t capacity;
+  uint16_t unused;
+  uint64_t free_map[SLAB_MAP_WORDS];         //bit i is set when object i is free
+
+} slab_s;
+
+#define SLABS_PER_SEGMENT     (SEGMENT_SIZE / SLAB_SIZE)
+#define SEGMENT_MAP_WORDS     ((SLABS_PER_SEGMENT + 63) / 64)
+
+typedef struct slab_segment {
+  segment_s segment;
+  size_t    free_slabs;                      //number of bits set in free_map
+  uint64_t  free_map[SEGMENT_MAP_WORDS];     //bit i is set when slab i is empty
+  uint64_t  dirty_map[SEGMENT_MAP_WORDS];    //bit i is set when empty slab i has not been purged
+
+} slab_segment_s;
+
+
+//returns the slab that holds the object at (ptr)
+static inline slab_s* slab_of (void* ptr) {
+  return (slab_s*) ((intptr_t) ptr & ~(intptr_t)(SLAB_SIZE - 1));
+}
+
+//returns the size of the objects in slabs of size class (index)
+static inline size_t slab_object_size (size_t index) {
+  return (index + 1) * ALIGNMENT;
+}
+
+
+//maps a new slab segment for (arena) and makes it the one slabs are bumped from
+static slab_segment_s* slab_segment_create (arena_s* arena) {
+
+  segment_s* segment = segment_create(arena, arena -> node, SEGMENT_SIZE, SEGMENT_SLABS);
+  if (segment == NULL) {
+    return NULL;
+  }
+
+  intptr_t first = ((intptr_t) segment + sizeof(slab_segment_s) + SLAB_SIZE - 1) & ~(intptr_t)(SLAB_SIZE - 1);
+  segment -> start_ptr = first;
+  segment -> last_unallocated_free_ptr = (void*) first;
+  segment -> high_water = (void*) first;
+
+  segment -> next = arena -> slab_segments;
+  arena -> slab_segments = segment;
+
+  return (slab_segment_s*) segment;
+}
+
+//takes an empty slab page from one of the slab segments of (arena), bumping or mapping a new one if none is empty
+static slab_s* slab_page_alloc (arena_s* arena) {
+
+  for (segment_s* segment = arena -> slab_segments; segment != NULL; segment = segment -> next) {
+    slab_segment_s* slabs = (slab_segment_s*) segment;
+    if (slabs -> free_slabs == 0) {
+      continue;
+    }
+
+    for (size_t word = 0; word < SEGMENT_MAP_WORDS; word += 1) {
+      if (slabs -> free_map[word] != 0) {
+        size_t   bit = __builtin_ctzll(slabs -> free_map[word]);
+        uint64_t clear = ~((uint64_t)1 << bit);
+        slabs -> free_map[word]  &= clear;
+        slabs -> dirty_map[word] &= clear;
+        slabs -> free_slabs -= 1;
+        return (slab_s*) ((intptr_t) segment + (word * 64 + bit) * SLAB_SIZE);
+      }
+    }
+  }
+
+  segment_s* segment = arena -> slab_segments;
+  if (segment == NULL || (intptr_t) segment -> last_unallocated_free_ptr + SLAB_SIZE > segment -> end_ptr) {
+    slab_segment_s* slabs = slab_segment_create(arena);
+    if (slabs == NULL) {
+      return NULL;
+    }
+    segment = &slabs -> segment;
+  }
+
+  slab_s* slab = (slab_s*) segment -> last_unallocated_free_ptr;
+  segment -> last_unallocated_free_ptr = (void*) ((intptr_t) slab + SLAB_SIZE);
+  segment -> high_water = segment -> last_unallocated_free_ptr;
+  return slab;
+}
+
+//gives the page of an empty slab back to its segment
+static void slab_page_free (arena_s* arena, slab_s* slab) {
+
+  slab_segment_s* slabs = (slab_segment_s*) segment_of(slab);
+  size_t          index = ((intptr_t) slab - (intptr_t) slabs) / SLAB_SIZE;
+  uint64_t        bit   = (uint64_t)1 << (index % 64);
+
+  slabs -> free_map[index / 64]  |= bit;
+  slabs -> dirty_map[index / 64] |= bit;
+  slabs -> free_slabs += 1;
+  arena -> dirty += SLAB_SIZE;
+}
+
+
+//pushes (slab) onto the partial list of its size class
+static void slab_partial_insert (arena_s* arena, slab_s* slab) {
+
+  slab_s** head = &arena -> slab_partial[slab -> size_class];
+
+  slab -> prev = NULL;
+  slab -> next = *head;
+  if (*head != NULL) {
+    (*head) -> prev = slab;
+  }
+  *head = slab;
+}
+
+//unlinks (slab) from the partial list of its size class
+static void slab_partial_remove (arena_s* arena, slab_s* slab) {
+
+  if (slab -> prev == NULL) {
+    arena -> slab_partial[slab -> size_class] = slab -> next;
+  } else {
+    slab -> prev -> next = slab -> next;
+  }
+  if (slab -> next != NULL) {
+    slab -> next -> prev = slab -> prev;
+  }
+}
+
+
+//sets up a new, empty slab for size class (index) and puts it on the partial list
+static slab_s* slab_create (arena_s* arena, size_t index) {
+
+  slab_s* slab = slab_page_alloc(arena);
+  if (slab == NULL) {
+    return NULL;
+  }
+
+  slab -> size_class = index;
+  slab -> count      = 0;
+  slab -> capacity   = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab_object_size(index);
+  for (size_t word = 0; word < SLAB_MAP_WORDS; word += 1) {
+    size_t first = word * 64;
+    slab -> free_map[word] = first >= slab -> capacity ? 0
+                           : slab -> capacity - first >= 64 ? ~(uint64_t)0
+                           : ((uint64_t)1 << (slab -> capacity - first)) - 1;
+  }
+
+  slab_partial_insert(arena, slab);
+  return slab;
+}
+
+//takes up to (count) objects of size class (index) from (arena)'s partial slabs, making new slabs when they run
+//out, and stores them at (out). A whole word of a slab's free_map is cleared at a time. The caller holds the
+//arena's lock. Returns how many it took.
+static size_t slab_alloc_batch (arena_s* arena, size_t index, void** out, size_t count) {
+
+  size_t taken = 0;
+  size_t size  = slab_object_size(index);
+
+  while (taken < count) {
+    slab_s* slab = arena -> slab_partial[index];
+    if (slab == NULL) {
+      slab = slab_create(arena, index);
+      if (slab == NULL) {
+        break;
+      }
+    }
+
+    intptr_t base = (intptr_t) slab + SLAB_HEADER_SIZE;
+    for (size_t word = 0; taken < count && slab -> count < slab -> capacity; word += 1) {
+      uint64_t bits = slab -> free_map[word];
+      while (bits != 0 && taken < count) {
+        out[taken++]   = (void*) (base + (word * 64 + __builtin_ctzll(bits)) * size);
+        bits          &= bits - 1;
+        slab -> count += 1;
+      }
+      slab -> free_map[word] = bits;
+    }
+
+    if (slab -> count == slab -> capacity) {
+      slab_partial_remove(arena, slab);
+    }
+  }
+
+  return taken;
+}
+
+//frees the object at (ptr) back to its slab. The caller holds the arena's lock.
+static void slab_free (arena_s* arena, void* ptr) {
+
+  slab_s* slab  = slab_of(ptr);
+  size_t  index = ((intptr_t) ptr - (intptr_t) slab - SLAB_HEADER_SIZE) / slab_object_size(slab -> size_class);
+
+#if defined (PB_HARDEN)
+  if (slab -> free_map[index / 64] & ((uint64_t)1 << (index % 64))) {
+    harden_fail("double free", ptr);
+  }
+#endif
+  slab -> free_map[index / 64] |= (uint64_t)1 << (index % 64);
+
+  if (slab -> count == slab -> capacity) {
+    slab_partial_insert(arena, slab);
+  }
+  slab -> count -= 1;
+
+  if (slab -> count == 0 && (slab -> next != NULL || slab -> prev != NULL)) {
+    slab_partial_remove(arena, slab);
+    slab_page_free(arena, slab);
+  }
+}
+
+
+//returns how many bytes the caller may use in the allocated block at (ptr)
+static inline size_t usable_size (void* ptr) {
+  if (segment_of(ptr) -> kind == SEGMENT_SLABS) {
+    return slab_object_size(slab_of(ptr) -> size_class);
+  }
+  return block_header(ptr) -> size;
+}
+
+//frees the slab object or block at (ptr), which (arena) owns. The caller holds the arena's lock.
+static inline void arena_free (arena_s* arena, void* ptr) {
+  if (segment_of(ptr) -> kind == SEGMENT_SLABS) {
+    slab_free(arena, ptr);
+  } else {
+    heap_free(arena, block_header(ptr));
+  }
+}
+
+
+//pushes (ptr), owned by (arena), onto its remote_free stack. Any thread may call this without the lock.
+//The stack is linked through the first word of each freed block.
+static void remote_free_push (arena_s* arena, void* ptr) {
+
+  void* head = __atomic_load_n(&arena -> remote_free, __ATOMIC_RELAXED);
+  do {
+    *(void**) ptr = head;
+  } while (!__atomic_compare_exchange_n(&arena -> remote_free, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+#if defined (PB_TLSF)
+#define REMOTE_DRAIN_MAX 64                      //remote frees a slow path takes care of, see Arenas
+#else
+#define REMOTE_DRAIN_MAX SIZE_MAX
+#endif
+
+//frees up to (limit) blocks of the remote_free stack of (arena), taking the whole stack onto remote_pending
+//once that is empty. The caller holds the arena's lock. Returns 0 once both are empty.
+static int remote_free_drain_some (arena_s* arena, size_t limit) {
+
+  void* ptr = arena -> remote_pending;
+  if (ptr == NULL) {
+    if (__atomic_load_n(&arena -> remote_free, __ATOMIC_RELAXED) == NULL) {
+      return 0;
+    }
+    ptr = __atomic_exchange_n(&arena -> remote_free, NULL, __ATOMIC_ACQUIRE);
+  }
+
+  for (; ptr != NULL && limit != 0; limit -= 1) {
+    void* next = *(void**) ptr;
+    arena_free(arena, ptr);
+    ptr = next;
+  }
+  arena -> remote_pending = ptr;
+  return 1;
+}
+
+//frees the remote frees of (arena) due on a slow path. The caller holds the arena's lock.
+static inline void remote_free_drain (arena_s* arena) {
+  remote_free_drain_some(arena, REMOTE_DRAIN_MAX);
+}
+
+//frees every block on the remote_free stack of (arena), however many. The caller holds the arena's lock.
+static void remote_free_drain_all (arena_s* arena) {
+  while (remote_free_drain_some(arena, SIZE_MAX)) {
+  }
+}
+
+
+/*
+ * Purging. Freed memory stays mapped and resident until a purge pass hands it back to the OS with madvise(). A
+ * pass walks every segment of an arena physically and releases the whole pages inside each free block, keeping its
+ * header and free list links, and every empty slab. Amortized passes use MADV_FREE where the kernel has it, which
+ * is cheap but only takes the pages away under memory pressure; malloc_trim() uses MADV_DONTNEED. A pass also
+ * releases the pages between the bump frontier and the segment's high_water mark with MADV_DONTNEED, so the bump
+ * region is zero-filled again, as if freshly mapped.
+ *
+ * Passes are amortized over the slow paths that already hold an arena's lock. One runs once purge_decay_ms (10 s
+ * unless PB_PURGE_DECAY_MS or the purge_decay_ms option says otherwise) have passed since the last one and at
+ * least PURGE_MIN_DIRTY bytes have been freed since. A decay time of 0 purges on every such path, and a negative
+ * one never purges on its own. malloc_trim() runs a pass over every arena on demand.
+ */
+#if !defined (PB_PURGE_DECAY_MS)
+#define PB_PURGE_DECAY_MS 10000
+#endif
+#define PURGE_MIN_DIRTY (16 * PAGE_SIZE)
+
+static long purge_decay_ms = PB_PURGE_DECAY_MS;
+
+//releases the whole pages of (page_size) bytes between (from) and (to) with (advice), falling back to
+//MADV_DONTNEED when the kernel rejects it. Returns the number of bytes released, which is 0 when the kernel
+//rejects MADV_DONTNEED too, as kernels before 5.18 do for hugetlb mappings.
+static size_t purge_range (intptr_t from, intptr_t to, int advice, size_t page_size) {
+
+  from = (from + page_size - 1) & ~(intptr_t)(page_size - 1);
+  to   = to & ~(intptr_t)(page_size - 1);
+  if (to <= from) {
+    return 0;
+  }
+
+  if (madvise((void*) from, to - from, advice) != 0) {
+    if (advice == MADV_DONTNEED || madvise((void*) from, to - from, MADV_DONTNEED) != 0) {
+      return 0;
+    }
+  }
+  return to - from;
+}
+
+#if defined (MADV_FREE)
+#define PURGE_ADVICE MADV_FREE
+#else
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
+
+//releases the free memory in (segment) with (advice), leaving (pad) bytes above the bump frontier alone. The
+//caller holds the arena's lock. Returns the number of bytes released.
+static size_t segment_purge (segment_s* segment, size_t pad, int advice) {
+
+  size_t released = 0;
+
+  for (link_s* block = (link_s*) segment -> start_ptr; (void*) block < segment -> last_unallocated_free_ptr; block = block_after(block)) {
+    if (block_flags(block) == 0) {
+      released += purge_range((intptr_t) (&block -> prev + 1), (intptr_t) block_after(block), advice, segment -> page_size);
+    }
+  }
+
+  //calloc() relies on everything above high_water reading as zero, so the range is widened to whole pages
+  //here rather than narrowed, and high_water only comes down when the pages were really released. It stays
+  //past the tag at the bump frontier, like bump_high_water() leaves it, since freeing the last block writes
+  //that tag. The segment ends on a page boundary.
+  size_t   page = segment -> page_size;
+  intptr_t keep = ((intptr_t) segment -> last_unallocated_free_ptr + BLOCK_OVERHEAD + pad + page - 1)
+                  & ~(intptr_t)(page - 1);
+  intptr_t top  = ((intptr_t) segment -> high_water + page - 1) & ~(intptr_t)(page - 1);
+  if (keep < top) {
+    size_t zeroed = purge_range(keep, top, MADV_DONTNEED, page);
+    if (zeroed != 0) {
+      released += zeroed;
+      segment -> high_water = (void*) keep;
+    }
+  }
+
+  return released;
+}
+
+//releases every huge page of a slab segment backed by huge pages whose slabs are all empty and not all purged
+//yet. The caller holds the arena's lock. Returns the number of bytes released.
+static size_t slab_segment_purge_huge (slab_segment_s* slabs, int advice) {
+
+  intptr_t base     = (intptr_t) slabs;
+  size_t   page     = slabs -> segment.page_size;
+  size_t   released = 0;
+
+  for (size_t first = 0; first < SLABS_PER_SEGMENT; first += page / SLAB_SIZE) {
+    size_t   last  = first + page / SLAB_SIZE;
+    uint64_t empty = ~(uint64_t) 0;
+    uint64_t dirty = 0;
+
+    for (size_t word = first / 64; word < last / 64; word += 1) {
+      empty &= slabs -> free_map[word];
+      dirty |= slabs -> dirty_map[word];
+    }
+    if (empty == ~(uint64_t) 0 && dirty != 0) {
+      released += purge_range(base + first * SLAB_SIZE, base + last * SLAB_SIZE, advice, page);
+      for (size_t word = first / 64; word < last / 64; word += 1) {
+        slabs -> dirty_map[word] = 0;
+      }
+    }
+  }
+  return released;
+}
+
+//releases every empty slab of a slab segment that has not been purged yet, one madvise() per run of adjacent
+//slabs. The caller holds the arena's lock. Returns the number of bytes released.
+static size_t slab_segment_purge (slab_segment_s* slabs, int advice) {
+
+  intptr_t base     = (intptr_t) slabs;
+  size_t   released = 0;
+  size_t   run      = 0;       //slabs in the current run, which ends before slab i
+
+  if (slabs -> segment.page_size > SLAB_SIZE) {
+    return slab_segment_purge_huge(slabs, advice);
+  }
+
+  for (size_t i = 0; i < SLABS_PER_SEGMENT; i += 1) {
+    uint64_t word = slabs -> free_map[i / 64] & slabs -> dirty_map[i / 64];
+    if (word >> (i % 64) & 1) {
+      run += 1;
+      continue;
+    }
+    if (run != 0) {
+      released += purge_range(base + (i - run) * SLAB_SIZE, base + i * SLAB_SIZE, advice, SLAB_SIZE);
+      run = 0;
+    }
+    if (word == 0 && i % 64 == 0) {
+      i += 63;
+    }
+  }
+  if (run != 0) {
+    released += purge_range(base + (SLABS_PER_SEGMENT - run) * SLAB_SIZE, base + SLABS_PER_SEGMENT * SLAB_SIZE, advice, SLAB_SIZE);
+  }
+
+  for (size_t word = 0; word < SEGMENT_MAP_WORDS; word += 1) {
+    slabs -> dirty_map[word] = 0;
+  }
+  return released;
+}
+
+//runs a purge pass over every segment of (arena). The caller holds the arena's lock.
+static size_t arena_purge (arena_s* arena, size_t pad, int advice) {
+
+  size_t released = 0;
+  for (segment_s* segment = arena -> segments; segment != NULL; segment = segment -> next) {
+    released += segment_purge(segment, pad, advice);
+  }
+  for (segment_s* segment = arena -> slab_segments; segment != NULL; segment = segment -> next) {
+    released += slab_segment_purge((slab_segment_s*) segment, advice);
+  }
+
+  arena -> dirty      = 0;
+  arena -> last_purge = now_ns();
+  return released;
+}
+
+//runs a purge pass over (arena) if its decay time has passed. The caller holds the arena's lock. A pass is
+//not bounded in time, so PB_TLSF builds, which promise constant-time malloc() and free(), leave purging to
+//malloc_trim() and pb_mallctl("trim").
+static inline void arena_maybe_purge (arena_s* arena) {
+
+#if defined (PB_TLSF)
+  (void) arena;
+#else
+  long decay_ms = __atomic_load_n(&purge_decay_ms, __ATOMIC_RELAXED);
+  if (decay_ms < 0 || arena -> dirty < PURGE_MIN_DIRTY) {
+    return;
+  }
+
+  if (now_ns() - arena -> last_purge >= (uint64_t) decay_ms * 1000000) {
+    arena_purge(arena, 0, PURGE_ADVICE);
+  }
+#endif
+}
+
+
+/*
+ * Thread caches. Each thread keeps a short LIFO stack of small blocks per size class, linked through the first
+ * word of each block, so slab objects and blocks with a header are cached alike. Blocks in a thread cache are
+ * still marked in use as far as the arena is concerned, so they are never coalesced. malloc() and free() only
+ * touch the calling thread's cache, without a lock or atomic instruction. The thread's arena is only locked to
+ * refill an empty stack or drain a full one, TCACHE_BATCH blocks at a time. A cache only ever holds blocks of its
+ * own thread's arena.
+ *
+ * limit is 0 until the thread first takes the slow path, picks an arena and registers tcache_key, whose destructor
+ * gives the cached blocks back when the thread exits. It is set to tcache_limit then, which the tcache_max option
+ * can change (see Configuration); a limit of 0 sends every block straight to the arena. After that the cache stays
+ * disabled (limit 0, dead set) so late free() calls from other TLS destructors go straight to the arena.
+ *
+ * The cache also holds the thread's statistics counters, trace buffer and object pool magazines (see Pools below).
+ * Caches of live threads are kept on the tcaches list so statistics can add them up, and the counters of exited
+ * threads are folded into retired_counters.
+ */
+#define TCACHE_MAX   32          //most blocks a thread caches per size class, unless the tcache_max option says otherwise
+#define TCACHE_LIMIT 1024        //highest tcache_max option
+#define TCACHE_BATCH 16          //blocks moved per refill or drain
+#define TRACE_EVENTS 4096        //trace events a thread buffers before writing them out, see below
+#define TRACE_BUFFER (TRACE_EVENTS * sizeof(pb_trace_event_s))
+
+#define COUNTER_CLASSES (NUM_SIZE_CLASSES + 1)   //one per size class, the last for everything larger
+
+#if !defined (PB_POOL_MAGAZINE)
+#define PB_POOL_MAGAZINE 32
+#endif
+#define POOL_MAGAZINE  ((unsigned) PB_POOL_MAGAZINE)   //most objects a thread keeps per pool, 0 for none
+#define POOL_MAGAZINES 8                               //pools a thread keeps objects of at once
+
+typedef struct pool_magazine {
+  pb_pool_s* pool;               //pool the objects belong to
+  uint64_t   serial;             //serial of (pool) when the magazine was taken, see Pools
+  void*      head;               //objects, linked through their first word
+  unsigned   count;
+
+} pool_magazine_s;
+
+typedef struct counters {
+  uint64_t mallocs[COUNTER_CLASSES];
+  uint64_t frees[COUNTER_CLASSES];
+
+} counters_s;
+
+typedef struct tcache {
+  void*    heads[NUM_SIZE_CLASSES];
+  unsigned counts[NUM_SIZE_CLASSES];
+  unsigned limit;
+  unsigned dead;
+  arena_s* arena;
+  counters_s     counters;
+  unsigned       listed;         //set while the cache is on the tcaches list
+  struct tcache* next;
+  int64_t        sample_left;    //bytes to allocate before the next heap profile sample
+  uint64_t       prng;           //state of the sampling random number generator
+  unsigned       sampling;       //set while a sample is being taken
+  pb_trace_event_s* trace;       //buffered trace events, mapped on the first one
+  unsigned       trace_count;
+  unsigned       trace_thread;   //thread number in the trace
+  unsigned       trace_nested;   //set while a traced call runs, so the calls it makes are not traced
+  unsigned       internal;       //set while the allocator calls code that may allocate, see Reentrancy
+  pool_magazine_s magazines[POOL_MAGAZINES];
+
+} tcache_s;
+
+static pthread_once_t   tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t    tcache_key;
+static __thread tcache_s tcache __attribute__ ((tls_model ("initial-exec")));
+static tcache_s*        tcaches;              //every listed cache, guarded by arenas_lock
+static counters_s       retired_counters;     //counters of exited threads, guarded by arenas_lock
+static unsigned         tcache_limit = TCACHE_MAX;   //limit a cache gets when its thread registers
+
+static void trace_flush (tcache_s* cache);
+static void pool_magazines_flush (tcache_s* cache);
+
+
+//returns the counter class of a block of (size) bytes
+static inline size_t counter_class (size_t size) {
+  return size <= SMALL_MAX ? size_class(size) : NUM_SIZE_CLASSES;
+}
+
+
+//cached_next() returns the block linked after the cached block (ptr), and cached_link() links (next) after it.
+//cached_clear() drops the mark of a block taken off a cache. In hardened builds the link is encoded and the
+//block is marked as cached, see Hardening above.
+#if defined (PB_HARDEN)
+static inline void* cached_next (void* ptr) {
+  uintptr_t next = *(uintptr_t*) ptr ^ (uintptr_t) ptr >> 12 ^ harden_key;
+  if (next & (ALIGNMENT - 1)) {
+    harden_fail("corrupted thread cache", ptr);
+  }
+  return (void*) next;
+}
+
+static inline void cached_link (void* ptr, void* next) {
+  ((uintptr_t*) ptr)[0] = (uintptr_t) next ^ (uintptr_t) ptr >> 12 ^ harden_key;
+  ((uintptr_t*) ptr)[1] = harden_key;
+}
+
+static inline void cached_clear (void* ptr) {
+  ((uintptr_t*) ptr)[1] = 0;
+}
+
+//aborts if the marked block (ptr) is on the cache list of size class (index) already
+COLD_PATH static void tcache_check_cached (tcache_s* cache, size_t index, void* ptr) {
+  for (void* block = cache -> heads[index]; block != NULL; block = cached_next(block)) {
+    if (block == ptr) {
+      harden_fail("double free", ptr);
+    }
+  }
+}
+
+//aborts unless (ptr) is an allocated slab object or block of (segment) with an intact header
+static inline void harden_check (void* ptr, segment_s* segment) {
+
+  if (segment -> kind == SEGMENT_SLABS) {
+    slab_s* slab   = slab_of(ptr);
+    size_t  object = slab_object_size(slab -> size_class);
+    size_t  offset = (intptr_t) ptr - (intptr_t) slab - SLAB_HEADER_SIZE;
+    size_t  index  = offset / object;
+    if (offset % object != 0 || index >= slab -> capacity) {
+      harden_fail("free() of an invalid pointer", ptr);
+    }
+    if (slab -> free_map[index / 64] & ((uint64_t)1 << (index % 64))) {
+      harden_fail("double free", ptr);
+    }
+    return;
+  }
+
+  link_s* block = block_header(ptr);
+  if (((uintptr_t) ptr & (ALIGNMENT - 1)) != 0 || block -> canary != block_canary(block, block -> size)) {
+    harden_fail("corrupted block header", ptr);
+  }
+  if (!(block_flags(block) & (BLOCK_IN_USE | BLOCK_MAPPED))) {
+    harden_fail("double free", ptr);
+  }
+}
+#else
+static inline void* cached_next (void* ptr)              { return *(void**) ptr; }
+static inline void  cached_link (void* ptr, void* next)  { *(void**) ptr = next; }
+static inline void  cached_clear (void* ptr)             { (void) ptr; }
+static inline void  harden_check (void* ptr, segment_s* segment) { (void) ptr; (void) segment; }
+#endif
+
+//pushes the freed block (ptr) onto the cache list of size class (index)
+static inline void tcache_push (tcache_s* cache, size_t index, void* ptr) {
+#if defined (PB_HARDEN)
+  if (((uintptr_t*) ptr)[1] == harden_key) {
+    tcache_check_cached(cache, index, ptr);
+  }
+#endif
+  cached_link(ptr, cache -> heads[index]);
+  cache -> heads[index]   = ptr;
+  cache -> counts[index] += 1;
+}
+
+//pops the head of the non-empty cache list of size class (index)
+static inline void* tcache_pop (tcache_s* cache, size_t index) {
+  void* ptr = cache -> heads[index];
+  cache -> heads[index]   = cached_next(ptr);
+  cache -> counts[index] -= 1;
+  cached_clear(ptr);
+  return ptr;
+}
+
+
+//returns every block in (cache) to its arena. The caller holds the arena's lock.
+static void tcache_flush (tcache_s* cache) {
+
+  for (size_t index = 0; index < NUM_SIZE_CLASSES; index += 1) {
+    while (cache -> heads[index] != NULL) {
+      arena_free(cache -> arena, tcache_pop(cache, index));
+    }
+  }
+}
+
+//returns every block in (cache) to its arena when the thread exits, and retires its counters
+static void tcache_destroy (void* arg) {
+
+  tcache_s* cache = (tcache_s*) arg;
+  arena_s*  arena = cache -> arena;
+
+  if (arena != NULL) {
+    pthread_mutex_lock(&arena -> lock);
+    remote_free_drain(arena);
+    tcache_flush(cache);
+    arena_maybe_purge(arena);
+    pthread_mutex_unlock(&arena -> lock);
+  }
+  pool_magazines_flush(cache);
+
+  pthread_mutex_lock(&arenas_lock);
+  if (cache -> listed) {
+    tcache_s** link = &tcaches;
+    while (*link != cache) {
+      link = &(*link) -> next;
+    }
+    *link = cache -> next;
+    cache -> listed = 0;
+
+    for (size_t index = 0; index < COUNTER_CLASSES; index += 1) {
+      retired_counters.mallocs[index] += cache -> counters.mallocs[index];
+      retired_counters.frees[index]   += cache -> counters.frees[index];
+    }
+    memset(&cache -> counters, 0, sizeof(cache -> counters));
+  }
+
+  if (cache -> trace != NULL) {
+    trace_flush(cache);
+    munmap(cache -> trace, TRACE_BUFFER);
+    cache -> trace = NULL;
+  }
+  pthread_mutex_unlock(&arenas_lock);
+
+  cache -> limit = 0;
+  cache -> dead  = 1;
+}
+
+static void tcache_create_key () {
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+//puts (cache) on the tcaches list and registers tcache_key, so its counters are retired when the thread exits.
+//The caller holds arenas_lock.
+static void tcache_list (tcache_s* cache) {
+
+  if (!cache -> listed && !cache -> dead) {
+    cache -> next   = tcaches;
+    tcaches         = cache;
+    cache -> listed = 1;
+    cache -> internal += 1;
+    pthread_once(&tcache_once, tcache_create_key);
+    pthread_setspecific(tcache_key, cache);
+    cache -> internal -= 1;
+  }
+}
+
+/*
+ * Reentrancy. Registering tcache_key calls into libc, and pthread_setspecific() callocs a block of its own
+ * once a thread uses more than 32 keys, which brings the thread back into the allocator before its cache is
+ * set up, and with arenas_lock held when tcache_list() is called from a slow path. Such a call would register
+ * again and recurse, or wait on the lock the thread holds. While internal is set, every slow path hands out a
+ * private mapping of its own instead (internal_malloc()), which takes no lock, and free() pushes blocks onto
+ * their arena's remote_free stack rather than locking it. The fast paths do not look at internal: the cache
+ * they use is empty or disabled until registration has finished.
+ */
+COLD_PATH static void* internal_malloc (size_t size, size_t alignment) {
+  return large_alloc(NULL, align_size(size), alignment);
+}
+
+//assigns the calling thread an arena and enables its cache the first time it reaches a slow path. Returns NULL
+//if no arena could be mapped.
+static inline arena_s* tcache_register (tcache_s* cache) {
+
+  if (cache -> arena == NULL) {
+    pthread_mutex_lock(&arenas_lock);
+    init();
+    unsigned node  = numa_node();
+    unsigned index = node * node_arenas + next_arena[node]++ % node_arenas;
+    if (arenas[index] == NULL) {
+      __atomic_store_n(&arenas[index], arena_create(node_ids[node]), __ATOMIC_RELEASE);
+    }
+    cache -> arena = arenas[index];
+    tcache_list(cache);
+    pthread_mutex_unlock(&arenas_lock);
+
+    if (cache -> arena == NULL) {
+      return NULL;
+    }
+  }
+
+  unsigned limit = __atomic_load_n(&tcache_limit, __ATOMIC_RELAXED);
+  if (cache -> limit == 0 && !cache -> dead && limit != 0) {
+    cache -> internal += 1;
+    pthread_once(&tcache_once, tcache_create_key);
+    pthread_setspecific(tcache_key, cache);
+    cache -> internal -= 1;
+    cache -> limit = limit;
+  }
+
+  return cache -> arena;
+}
+
+
+//takes up to (count) blocks of size class (index) from (arena) and stores them at (out). The caller holds the
+//arena's lock. Returns how many it took.
+static size_t arena_alloc_batch (arena_s* arena, size_t index, void** out, size_t count) {
+
+  if (index < SLAB_CLASSES) {
+    return slab_alloc_batch(arena, index, out, count);
+  }
+
+  size_t taken = 0;
+  while (taken < count && (out[taken] = heap_alloc(arena, (index + 1) * ALIGNMENT, NULL)) != NULL) {
+    taken += 1;
+  }
+  return taken;
+}
+
+//takes a batch of blocks of size class (index) from the thread's arena, caches all but one and returns that one.
+//The cached blocks are linked up first and spliced onto the cache in one step.
+SLOW_PATH static void* tcache_refill (tcache_s* cache, size_t index) {
+
+  if (__builtin_expect(cache -> internal, 0)) {
+    return internal_malloc((index + 1) * ALIGNMENT, ALIGNMENT);
+  }
+
+  arena_s* arena = tcache_register(cache);
+  void*    batch[TCACHE_BATCH];
+  size_t   want  = cache -> limit < TCACHE_BATCH ? cache -> limit : TCACHE_BATCH;
+  size_t   taken;
+
+  if (arena == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&arena -> lock);
+  remote_free_drain(arena);
+  taken = arena_alloc_batch(arena, index, batch, want != 0 ? want : 1);
+  arena_maybe_purge(arena);
+  pthread_mutex_unlock(&arena -> lock);
+
+  if (taken == 0) {
+    return NULL;
+  }
+
+  if (taken > 1) {
+    for (size_t i = 1; i < taken - 1; i += 1) {
+      cached_link(batch[i], batch[i + 1]);
+    }
+    cached_link(batch[taken - 1], cache -> heads[index]);
+    cache -> heads[index]   = batch[1];
+    cache -> counts[index] += taken - 1;
+  }
+
+  return batch[0];
+}
+
+//returns the header free() will read to give the cached block at (ptr) of size class (index) back to its arena
+static inline void* tcache_header_of (void* ptr, size_t index) {
+  return index < SLAB_CLASSES ? (void*) slab_of(ptr) : (void*) block_header(ptr);
+}
+
+//gives (ptr) and a batch of cached blocks of the same size class back to the thread's arena. The header of each
+//block is prefetched while the one before it is freed.
+SLOW_PATH static void tcache_drain (tcache_s* cache, void* ptr, size_t index) {
+
+  arena_s* arena = cache -> arena;
+  void*    block;
+  unsigned count;
+
+  pthread_mutex_lock(&arena -> lock);
+  arena_free(arena, ptr);
+  block = cache -> heads[index];
+  for (count = 0; count < TCACHE_BATCH && block != NULL; count += 1) {
+    void* next = cached_next(block);
+    if (next != NULL) {
+      __builtin_prefetch(tcache_header_of(next, index), 1);
+    }
+    cached_clear(block);
+    arena_free(arena, block);
+    block = next;
+  }
+  cache -> heads[index]   = block;
+  cache -> counts[index] -= count;
+  arena_maybe_purge(arena);
+  pthread_mutex_unlock(&arena -> lock);
+}
+
+
+static void* malloc_unsampled (size_t size);
+static void* malloc_arena (size_t size);
+static void  free_block (void* ptr, segment_s* segment, size_t size);
+static void  free_unusual (void* ptr, segment_s* segment);
+
+/*
+ * Heap profiler. Setting PB_PROF_SAMPLE to a number of bytes turns on sampling: each thread counts down the
+ * bytes it allocates from a random point drawn from an exponential distribution with that mean, and the
+ * malloc() that crosses zero is sampled. A sampled block always comes from the arena heap or its own mapping,
+ * never from a slab, so it has a header, and BLOCK_SAMPLED is set in its tag. We record its size and a
+ * backtrace in prof_table, and free() drops the record when it sees the flag. With sampling off the countdown
+ * never crosses zero, so malloc() only pays a thread-local subtraction and free() a test of a header word it
+ * already reads.
+ *
+ * pb_prof_dump() writes the live samples in the legacy heap profile format that pprof reads, tagged with the
+ * sampling period so pprof can scale the samples back up. Setting PB_PROF_FILE as well dumps to that file at
+ * exit.
+ */
+#define BLOCK_SAMPLED  4                  //flag of a block with a record in prof_table
+#define PROF_DEPTH     32                 //most frames recorded per sample
+#define PROF_BUCKETS   4096
+#define PROF_CHUNK     (64 * 1024)        //bytes mapped at a time for records
+
+typedef struct prof_record {
+  struct prof_record* next;
+  void*  ptr;
+  size_t size;
+  int    depth;
+  void*  stack[PROF_DEPTH];
+
+} prof_record_s;
+
+static prof_record_s*  prof_table[PROF_BUCKETS];
+static prof_record_s*  prof_free_records;
+static size_t          prof_live;         //records in prof_table
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+//returns the prof_table bucket of the block at (ptr)
+static inline prof_record_s** prof_bucket (void* ptr) {
+  return &prof_table[((uint64_t)(intptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ull >> 52];
+}
+
+//returns an unused record, mapping a new chunk of them if there is none. The caller holds prof_lock.
+static prof_record_s* prof_record_alloc () {
+
+  if (prof_free_records == NULL) {
+    prof_record_s* chunk = mmap(NULL, PROF_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+      return NULL;
+    }
+    for (size_t i = 0; i < PROF_CHUNK / sizeof(prof_record_s); i += 1) {
+      chunk[i].next     = prof_free_records;
+      prof_free_records = &chunk[i];
+    }
+  }
+
+  prof_record_s* record = prof_free_records;
+  prof_free_records = record -> next;
+  return record;
+}
+
+//returns the number of bytes the calling thread allocates before its next sample. -ln(u) of a uniform u is
+//computed as e * ln 2 + ln m, with u = m * 2^e and ln m from a short atanh series, to stay clear of libm.
+static int64_t prof_next_sample (tcache_s* cache) {
+
+  if (cache -> prng == 0) {
+    cache -> prng = (uint64_t)(intptr_t) cache ^ now_ns() ^ 0x2545F4914F6CDD1Dull;
+  }
+  cache -> prng ^= cache -> prng >> 12;
+  cache -> prng ^= cache -> prng << 25;
+  cache -> prng ^= cache -> prng >> 27;
+  uint64_t bits = (cache -> prng * 0x2545F4914F6CDD1Dull) >> 11;        //53 random bits
+
+  int    e = 0;
+  double m = (bits + 1) / 9007199254740992.0;                          //u in (0, 1]
+  while (m < 0.5) {
+    m *= 2;
+    e -= 1;
+  }
+  double t     = (m - 1) / (m + 1);
+  double t2    = t * t;
+  double ln_u  = e * 0.6931471805599453 + 2 * t * (1 + t2 / 3 + t2 * t2 / 5 + t2 * t2 * t2 / 7);
+
+  return (int64_t) (-ln_u * prof_interval) + 1;
+}
+
+//allocates a block of (size) bytes, an already aligned size, when the calling thread's sampling countdown
+//crossed zero, and records the block if sampling is on. Allocations made while taking the backtrace, which can
+//load libgcc on its first call, are not sampled.
+COLD_PATH static void* prof_malloc (size_t size) {
+
+  tcache_s* cache = &tcache;
+  if (__builtin_expect(cache -> internal, 0)) {
+    return internal_malloc(size, ALIGNMENT);
+  }
+
+  arena_s*  arena = tcache_register(cache);
+  void*     new_block_ptr;
+
+  if (arena == NULL) {
+    return NULL;
+  }
+
+  if (prof_interval == 0 || cache -> sampling) {
+    if (prof_interval == 0) {
+      cache -> sample_left = INT64_MAX;
+    }
+    return malloc_unsampled(size);
+  }
+
+  cache -> sampling    = 1;
+  cache -> sample_left = prof_next_sample(cache);
+
+  if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) || size > SEGMENT_MAX_BLOCK) {
+    new_block_ptr = large_alloc(arena, size, ALIGNMENT);
+  } else {
+    pthread_mutex_lock(&arena -> lock);
+    remote_free_drain(arena);
+    new_block_ptr = heap_alloc(arena, size, NULL);
+    pthread_mutex_unlock(&arena -> lock);
+  }
+
+  if (new_block_ptr != NULL) {
+    void* stack[PROF_DEPTH + 1];
+    int   depth = backtrace(stack, PROF_DEPTH + 1) - 1;      //without prof_malloc() itself
+
+    pthread_mutex_lock(&prof_lock);
+    prof_record_s* record = prof_record_alloc();
+    if (record != NULL) {
+      record -> ptr   = new_block_ptr;
+      record -> size  = size;
+      record -> depth = depth < 0 ? 0 : depth;
+      memcpy(record -> stack, stack + 1, record -> depth * sizeof(void*));
+
+      prof_record_s** bucket = prof_bucket(new_block_ptr);
+      record -> next = *bucket;
+      *bucket        = record;
+      prof_live     += 1;
+
+      link_s* block = block_header(new_block_ptr);
+      set_block_flags(block, block_flags(block) | BLOCK_SAMPLED);
+    }
+    pthread_mutex_unlock(&prof_lock);
+  }
+
+  cache -> sampling = 0;
+  return new_block_ptr;
+}
+
+//drops the record of the sampled block at (ptr) and clears its flag
+COLD_PATH static void prof_free (void* ptr) {
+
+  pthread_mutex_lock(&prof_lock);
+  prof_record_s** link = prof_bucket(ptr);
+  while (*link != NULL && (*link) -> ptr != ptr) {
+    link = &(*link) -> next;
+  }
+  if (*link != NULL) {
+    prof_record_s* record = *link;
+    *link = record -> next;
+    record -> next    = prof_free_records;
+    prof_free_records = record;
+    prof_live        -= 1;
+  }
+  pthread_mutex_unlock(&prof_lock);
+
+  link_s* block = block_header(ptr);
+  set_block_flags(block, block_flags(block) & ~(size_t) BLOCK_SAMPLED);
+}
+
+//writes the live samples to the file at (path) as a pprof heap profile, followed by the memory map pprof needs
+//to symbolize them. Returns 0, or -1 with errno set.
+int pb_prof_dump (const char* path) {
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&prof_lock);
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < PROF_BUCKETS; i += 1) {
+    for (prof_record_s* record = prof_table[i]; record != NULL; record = record -> next) {
+      bytes += record -> size;
+    }
+  }
+  fd_printf(fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", prof_live, bytes, prof_live, bytes, prof_interval);
+
+  for (size_t i = 0; i < PROF_BUCKETS; i += 1) {
+    for (prof_record_s* record = prof_table[i]; record != NULL; record = record -> next) {
+      fd_printf(fd, "1: %zu [1: %zu] @", record -> size, record -> size);
+      for (int frame = 0; frame < record -> depth; frame += 1) {
+        fd_printf(fd, " %p", record -> stack[frame]);
+      }
+      fd_printf(fd, "\n");
+    }
+  }
+
+  pthread_mutex_unlock(&prof_lock);
+
+  fd_printf(fd, "\nMAPPED_LIBRARIES:\n");
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps >= 0) {
+    char    buffer[4096];
+    ssize_t length;
+    while ((length = read(maps, buffer, sizeof(buffer))) > 0) {
+      write(fd, buffer, length);
+    }
+    close(maps);
+  }
+
+  return close(fd);
+}
+
+//dumps the heap profile at exit when PB_PROF_FILE asks for it
+__attribute__ ((destructor)) static void prof_dump_at_exit () {
+  const char* path = getenv("PB_PROF_FILE");
+  if (prof_interval != 0 && path != NULL && *path != '\0') {
+    pb_prof_dump(path);
+  }
+}
+
+
+/*
+ * Allocation traces. When PB_TRACE names a file, init() opens it and every public entry point hands its call
+ * to one of the trace_*() functions below, which makes the call with the thread's trace_nested flag set and
+ * then logs it. The flag keeps the malloc() and free() calls that realloc() and calloc() make themselves out of
+ * the trace. A free() is logged before the block is released, and an allocation after it is made, so an
+ * address that another thread reuses never shows up as allocated twice.
+ *
+ * Events go into a buffer of TRACE_EVENTS per thread, mapped on the first one, which is written to the file
+ * under trace_lock when it fills up, when the thread exits and at exit. Events logged after that, by TLS and exit
+ * destructors, are written one at a time. With tracing off the entry points only pay a test of trace_fd.
+ */
+#define TRACING() (__builtin_expect(trace_fd >= 0, 0) && !tcache.trace_nested)
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned        trace_threads;                        //threads numbered so far
+static int             trace_unbuffered;                     //set once the exit flush ran
+
+
+//writes (length) bytes of events at (events) to the trace file
+static void trace_write (const void* events, size_t length) {
+
+  pthread_mutex_lock(&trace_lock);
+  while (length > 0) {
+    ssize_t written = write(trace_fd, events, length);
+    if (written <= 0) {
+      break;
+    }
+    events  = (const char*) events + written;
+    length -= written;
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+//writes out the events buffered in (cache)
+static void trace_flush (tcache_s* cache) {
+  if (cache -> trace_count > 0) {
+    trace_write(cache -> trace, cache -> trace_count * sizeof(pb_trace_event_s));
+    cache -> trace_count = 0;
+  }
+}
+
+//logs a call (op) of the calling thread
+static void trace_record (uint32_t op, void* ptr, uint64_t arg, size_t size) {
+
+  tcache_s*        cache = &tcache;
+  pb_trace_event_s event = { now_ns(), (uint64_t)(intptr_t) ptr, arg, size, cache -> trace_thread, op };
+
+  if (cache -> trace_thread == 0) {
+    event.thread = cache -> trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+  }
+
+  if (cache -> trace == NULL && !cache -> dead && !trace_unbuffered) {
+    void* buffer = mmap(NULL, TRACE_BUFFER, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer != MAP_FAILED) {
+      pthread_mutex_lock(&arenas_lock);
+      cache -> trace = buffer;
+      tcache_list(cache);
+      pthread_mutex_unlock(&arenas_lock);
+    }
+  }
+
+  if (cache -> trace == NULL || trace_unbuffered) {
+    trace_write(&event, sizeof(event));
+    return;
+  }
+
+  cache -> trace[cache -> trace_count++] = event;
+  if (cache -> trace_count == TRACE_EVENTS) {
+    trace_flush(cache);
+  }
+}
+
+COLD_PATH static void* trace_malloc (size_t size) {
+  tcache.trace_nested = 1;
+  void* ptr = malloc(size);
+  tcache.trace_nested = 0;
+  trace_record(PB_TRACE_MALLOC, ptr, 0, size);
+  return ptr;
+}
+
+COLD_PATH static void trace_free (void* ptr) {
+  trace_record(PB_TRACE_FREE, ptr, 0, 0);
+  tcache.trace_nested = 1;
+  free(ptr);
+  tcache.trace_nested = 0;
+}
+
+COLD_PATH static void* trace_calloc (size_t nmemb, size_t size) {
+  tcache.trace_nested = 1;
+  void* ptr = calloc(nmemb, size);
+  tcache.trace_nested = 0;
+  trace_record(PB_TRACE_CALLOC, ptr, 0, nmemb * size);
+  return ptr;
+}
+
+COLD_PATH static void* trace_realloc (void* old_ptr, size_t size) {
+  uint64_t old = (uint64_t)(intptr_t) old_ptr;
+  tcache.trace_nested = 1;
+  void* ptr = realloc(old_ptr, size);
+  tcache.trace_nested = 0;
+  trace_record(PB_TRACE_REALLOC, ptr, old, size);
+  return ptr;
+}
+
+static void* aligned_malloc (size_t alignment, size_t size);
+
+COLD_PATH static void* trace_aligned_malloc (size_t alignment, size_t size) {
+  tcache.trace_nested = 1;
+  void* ptr = aligned_malloc(alignment, size);
+  tcache.trace_nested = 0;
+  trace_record(PB_TRACE_MEMALIGN, ptr, alignment, size);
+  return ptr;
+}
+
+//writes out the buffers of every listed thread at exit. Threads still running may lose the events they log
+//while this runs. Later events are written as they come.
+__attribute__ ((destructor)) static void trace_flush_at_exit () {
+
+  if (trace_fd < 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&arenas_lock);
+  trace_unbuffered = 1;
+  for (tcache_s* cache = tcaches; cache != NULL; cache = cache -> next) {
+    if (cache -> trace != NULL) {
+      trace_flush(cache);
+    }
+  }
+  pthread_mutex_unlock(&arenas_lock);
+}
+
+
+/*
+ * malloc allocates a block of memory of atleast (size) bytes and returns a pointer to this block
+ * malloc will preferentially allocate blocks that were made with free().
+ *
+ * Small requests pop the thread cache for their size class. Large requests get a mapping of their own.
+ * Everything else goes to the thread's arena. Returns NULL with errno set to ENOMEM when we run
+ * out of memory. Every so often the heap profiler takes the request instead, see above.
+  */
+
+void* malloc (size_t size) {
+
+  if (TRACING()) {
+    return trace_malloc(size);
+  }
+
+  size = align_size(size);
+  tcache.counters.mallocs[counter_class(size)] += 1;
+
+  if (__builtin_expect((tcache.sample_left -= (int64_t) size) < 0, 0)) {
+    return prof_malloc(size);
+  }
+
+  return malloc_unsampled(size);
+
+} // malloc()
+
+
+//does the work of malloc() for (size), an already aligned size, or 0 if aligning it wrapped around. Only the
+//thread cache pop is inlined.
+static inline void* malloc_unsampled (size_t size) {
+
+  if (__builtin_expect(size - 1 < SMALL_MAX, 1)) {
+    tcache_s* cache = &tcache;
+    size_t    index = size_class(size);
+    void*     ptr   = cache -> heads[index];
+
+    if (__builtin_expect(ptr != NULL, 1)) {
+      return tcache_pop(cache, index);
+    }
+
+    return tcache_refill(cache, index);
+  }
+
+  return malloc_arena(size);
+}
+
+//allocates a block of (size) bytes, an already aligned size above SMALL_MAX, from the thread's arena or a
+//mapping of its own. Sizes of half the address space or more fail with ENOMEM.
+SLOW_PATH static void* malloc_arena (size_t size) {
+
+  void* new_block_ptr;
+
+  if (size - 1 >= SIZE_MAX / 2) {                      //0 when align_size() wrapped around
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (__builtin_expect(tcache.internal, 0)) {
+    return internal_malloc(size, ALIGNMENT);
+  }
+
+  arena_s* arena = tcache_register(&tcache);
+  if (arena == NULL) {
+    return NULL;
+  }
+
+  if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) || size > SEGMENT_MAX_BLOCK) {
+    return large_alloc(arena, size, ALIGNMENT);
+  }
+
+  pthread_mutex_lock(&arena -> lock);
+  remote_free_drain(arena);
+  new_block_ptr = heap_alloc(arena, size, NULL);
+  pthread_mutex_unlock(&arena -> lock);
+
+  return new_block_ptr;
+}
+
+
+//free takes a ptr to an allocated block (not its header) and deallocates it. The segment header says what
+//kind of memory it is: large blocks are unmapped right away, slab objects and small blocks of the thread's own
+//arena go onto the thread cache for their size class, and other blocks of its own arena straight back to the
+//arena. Blocks of another arena are pushed onto that arena's remote_free stack.
+//
+//Only the thread cache push is inlined. Everything else is in free_block() and free_unusual().
+void free (void* ptr) {
+ 
+  if (ptr == NULL) {
+    return;
+  }
+
+  if (TRACING()) {
+    trace_free(ptr);
+    return;
+  }
+  
+  segment_s* segment = segment_of(ptr); 
+  size_t     size;
+
+  harden_check(ptr, segment);
+  if (segment -> kind == SEGMENT_SLABS) {
+    size = slab_object_size(slab_of(ptr) -> size_class);
+  } else if (__builtin_expect(segment -> kind == SEGMENT_BLOCKS && !(block_header(ptr) -> tag & BLOCK_SAMPLED), 1)) {
+    size = block_header(ptr) -> size;
+  } else {
+    free_unusual(ptr, segment);
+    return;
+  }
+
+  tcache_s* cache = &tcache;
+  size_t    index = size_class(size);
+
+  if (__builtin_expect(size <= SMALL_MAX && segment -> arena == cache -> arena && cache -> counts[index] < cache -> limit, 1)) {
+    cache -> counters.frees[index] += 1;
+    tcache_push(cache, index, ptr);
+    return;
+  }
+
+  free_block(ptr, segment, size);
+   
+} // free()
+
+
+//frees the slab object or block at (ptr), of (size) bytes, when it cannot simply go onto the thread cache
+SLOW_PATH static void free_block (void* ptr, segment_s* segment, size_t size) {
+
+  arena_s* arena = segment -> arena;
+
+  tcache.counters.frees[counter_class(size)] += 1;
+
+  if (__builtin_expect(tcache.internal, 0)) {           //no lock may be taken, see Reentrancy
+    remote_free_push(arena, ptr);
+    return;
+  }
+
+  if (arena != tcache.arena) {
+    if (!tcache.listed && !tcache.dead) {
+      pthread_mutex_lock(&arenas_lock);
+      tcache_list(&tcache);
+      pthread_mutex_unlock(&arenas_lock);
+    }
+    remote_free_push(arena, ptr);
+    return;
+  }
+
+  if (size <= SMALL_MAX) {
+    tcache_s* cache = &tcache;
+    size_t    index = size_class(size);
+
+    if (cache -> counts[index] < cache -> limit) {
+      tcache_push(cache, index, ptr);
+      return;
+    }
+
+    if (!cache -> dead) {
+      tcache_drain(cache, ptr, index);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&arena -> lock);
+  arena_free(arena, ptr);
+  arena_maybe_purge(arena);
+  pthread_mutex_unlock(&arena -> lock);
+}
+
+//frees a large block or a block sampled by the heap profiler
+COLD_PATH static void free_unusual (void* ptr, segment_s* segment) {
+
+  if (block_header(ptr) -> tag & BLOCK_SAMPLED) {
+    prof_free(ptr);
+  }
+
+  if (segment -> kind == SEGMENT_LARGE) {
+    tcache.counters.frees[NUM_SIZE_CLASSES] += 1;
+    large_free(segment);
+    return;
+  }
+
+  free_block(ptr, segment, block_header(ptr) -> size);
+}
+
+
+/*
+ * free_sized takes the (size) the block at (ptr) was asked for, as in C23. A slab object of the thread's own
+ * arena goes straight onto the thread cache for the size class of (size), without reading its slab header:
+ * only the segment header, which every free() reads, and the object's first word, which links it into the cache.
+ * That relies on a slab object always having the class of the size it was last asked for, which realloc()
+ * keeps true. Everything else, and every size that does not look like a slab object, goes through free(), which
+ * reads the block header anyway and takes it over the caller's size.
+ */
+void free_sized (void* ptr, size_t size) {
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  segment_s* segment = segment_of(ptr);
+  tcache_s*  cache   = &tcache;
+
+  if (size <= SLAB_MAX && segment -> kind == SEGMENT_SLABS && segment -> arena == cache -> arena && !TRACING()) {
+    size_t index = size_class(align_size(size));
+
+    if (cache -> counts[index] < cache -> limit) {
+      harden_check(ptr, segment);
+      cache -> counters.frees[index] += 1;
+      tcache_push(cache, index, ptr);
+      return;
+    }
+  }
+
+  free(ptr);
+
+} // free_sized()
+
+
+//free_aligned_sized frees a block of (size) bytes asked for with (alignment), as in C23. Blocks aligned more
+//strictly than ALIGNMENT are never slab objects.
+void free_aligned_sized (void* ptr, size_t alignment, size_t size) {
+
+  if (alignment <= ALIGNMENT) {
+    free_sized(ptr, size);
+  } else {
+    free(ptr);
+  }
+}
+
+
+/*
+ * Batches. pb_malloc_batch() stores up to (count) blocks of (size) bytes at (out), and returns how many it
+ * allocated, setting errno to ENOMEM when that is fewer. Small blocks come off the thread cache first and the
+ * rest straight from the arena under a single lock, a whole slab word at a time. When the batch would cross
+ * the heap profiler's sampling point, or the calls are traced, it falls back to one malloc() per block, so
+ * both still see every block.
+ *
+ * pb_free_batch() frees the (count) blocks at (ptrs), which may be NULL. Blocks that fit go onto the thread
+ * cache, and the other blocks of the thread's own arena are freed under a single lock. Anything else goes
+ * through free().
+ */
+size_t pb_malloc_batch (size_t size, size_t count, void** out) {
+
+  tcache_s* cache   = &tcache;
+  size_t    aligned = align_size(size);
+  size_t    taken   = 0;
+
+  if (size > SMALL_MAX || count > INT64_MAX / SMALL_MAX || TRACING() || cache -> sample_left < (int64_t) (aligned * count)) {
+    while (taken < count && (out[taken] = malloc(size)) != NULL) {
+      taken += 1;
+    }
+    return taken;
+  }
+
+  size_t index = size_class(aligned);
+  while (taken < count && cache -> heads[index] != NULL) {
+    out[taken++] = tcache_pop(cache, index);
+  }
+
+  if (taken < count) {
+    arena_s* arena = tcache_register(cache);
+    if (arena != NULL) {
+      pthread_mutex_lock(&arena -> lock);
+      remote_free_drain(arena);
+      taken += arena_alloc_batch(arena, index, out + taken, count - taken);
+      arena_maybe_purge(arena);
+      pthread_mutex_unlock(&arena -> lock);
+    }
+    if (taken < count) {
+      errno = ENOMEM;
+    }
+  }
+
+  cache -> counters.mallocs[index] += taken;
+  cache -> sample_left             -= (int64_t) (aligned * taken);
+  return taken;
+
+} // pb_malloc_batch()
+
+
+void pb_free_batch (void** ptrs, size_t count) {
+
+  tcache_s* cache  = &tcache;
+  arena_s*  locked = NULL;
+
+  for (size_t i = 0; i < count; i += 1) {
+    void* ptr = ptrs[i];
+    if (ptr == NULL) {
+      continue;
+    }
+
+    segment_s* segment = segment_of(ptr);
+    size_t     size;
+
+    if (TRACING()) {
+      size = 0;
+    } else if (segment -> kind == SEGMENT_SLABS) {
+      size = slab_object_size(slab_of(ptr) -> size_class);
+    } else if (segment -> kind == SEGMENT_BLOCKS && !(block_header(ptr) -> tag & BLOCK_SAMPLED)) {
+      size = block_header(ptr) -> size;
+    } else {
+      size = 0;
+    }
+
+    if (size == 0 || segment -> arena != cache -> arena) {
+      if (locked != NULL) {
+        pthread_mutex_unlock(&locked -> lock);
+        locked = NULL;
+      }
+      free(ptr);
+      continue;
+    }
+
+    harden_check(ptr, segment);
+    cache -> counters.frees[counter_class(size)] += 1;
+
+    size_t index = size_class(size);
+    if (size <= SMALL_MAX && cache -> counts[index] < cache -> limit) {
+      tcache_push(cache, index, ptr);
+      continue;
+    }
+
+    if (locked == NULL) {
+      locked = segment -> arena;
+      pthread_mutex_lock(&locked -> lock);
+    }
+    arena_free(locked, ptr);
+  }
+
+  if (locked != NULL) {
+    arena_maybe_purge(locked);
+    pthread_mutex_unlock(&locked -> lock);
+  }
+
+} // pb_free_batch()
+
+
+/*
+ * Regions. A region hands out memory by bumping a pointer through chunks it gets from malloc(), without a
+ * header per object, and gives it all back at once when it is reset or destroyed. Its objects cannot be freed
+ * one by one. The first chunk holds (chunk_size) bytes, or REGION_CHUNK bytes when that is 0, and each chunk
+ * after it doubles up to REGION_CHUNK_MAX, so a region grows in a few steps to what its requests need.
+ * Objects bigger than a quarter of a chunk get a chunk of their own, so they do not waste the rest of it.
+ *
+ * pb_region_reset() keeps the chunk it bumps from, the largest so far, and frees the others, so a region
+ * reused for one request after another stops calling malloc() once it has grown. A region belongs to one thread
+ * at a time; nothing in it is locked.
+ */
+#define REGION_CHUNK     KB(64)
+#define REGION_CHUNK_MAX MB(1)
+
+typedef struct region_chunk {
+  struct region_chunk* next;      //chunk given out before this one
+  size_t               size;      //bytes in the chunk, with this header
+
+} region_chunk_s;
+
+struct pb_region {
+  region_chunk_s* chunks;         //the chunk bumped from, then the older chunks
+  intptr_t        free_ptr;       //next free byte of chunks
+  intptr_t        end_ptr;        //end of chunks
+  size_t          chunk_size;     //size of the next chunk to get
+
+};
+
+pb_region_s* pb_region_create (size_t chunk_size) {
+
+  pb_region_s* region = malloc(sizeof(pb_region_s));
+  if (region == NULL) {
+    return NULL;
+  }
+
+  region -> chunks     = NULL;
+  region -> free_ptr   = 0;
+  region -> end_ptr    = 0;
+  region -> chunk_size = chunk_size == 0 ? REGION_CHUNK : align_size(chunk_size + sizeof(region_chunk_s));
+  return region;
+}
+
+//gets a chunk with room for (size) bytes. A big object gets its own chunk, kept behind the one bumped from;
+//otherwise the new chunk is bumped from next.
+static SLOW_PATH void* region_grow (pb_region_s* region, size_t size) {
+
+  size_t length = size + sizeof(region_chunk_s);
+
+  if (size > region -> chunk_size / 4 && region -> chunks != NULL) {
+    region_chunk_s* chunk = malloc(length);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk -> size = length;
+    chunk -> next = region -> chunks -> next;
+    region -> chunks -> next = chunk;
+    return chunk + 1;
+  }
+
+  if (length < region -> chunk_size) {
+    length = region -> chunk_size;
+  }
+  region_chunk_s* chunk = malloc(length);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  chunk -> size = length;
+  chunk -> next = region -> chunks;
+  region -> chunks   = chunk;
+  region -> free_ptr = (intptr_t) (chunk + 1) + size;
+  region -> end_ptr  = (intptr_t) chunk + length;
+
+  if (region -> chunk_size < REGION_CHUNK_MAX) {
+    region -> chunk_size *= 2;
+  }
+  return chunk + 1;
+}
+
+void* pb_region_alloc (pb_region_s* region, size_t size) {
+
+  if (size > SIZE_MAX / 2) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size = align_size(size);
+
+  intptr_t ptr = region -> free_ptr;
+  if (__builtin_expect(size <= (size_t) (region -> end_ptr - ptr), 1)) {
+    region -> free_ptr = ptr + size;
+    return (void*) ptr;
+  }
+
+  return region_grow(region, size);
+}
+
+void pb_region_reset (pb_region_s* region) {
+
+  region_chunk_s* chunk = region -> chunks;
+  if (chunk == NULL) {
+    return;
+  }
+
+  for (region_chunk_s* next = chunk -> next; next != NULL; ) {
+    region_chunk_s* older = next -> next;
+    free(next);
+    next = older;
+  }
+
+  chunk -> next = NULL;
+  region -> free_ptr = (intptr_t) (chunk + 1);
+  region -> end_ptr  = (intptr_t) chunk + chunk -> size;
+}
+
+void pb_region_destroy (pb_region_s* region) {
+
+  if (region == NULL) {
+    return;
+  }
+
+  pb_region_reset(region);
+  free(region -> chunks);
+  free(region);
+}
+
+
+/*
+ * Pools. A pool hands out objects of one size from chunks it gets from aligned_alloc(), with no header per
+ * object and no size lookup. Freed objects go onto an intrusive free list, linked through their first word,
+ * and new ones are bumped off the newest chunk, so chunk pages are only touched as they are used. Objects
+ * start on a cache line at the head of each chunk and are packed back to back: objects of a size dividing
+ * 64 never straddle two lines, and an alignment of 64 gives each object lines of its own.
+ *
+ * Each thread keeps a magazine of up to POOL_MAGAZINE free objects (32 unless PB_POOL_MAGAZINE says
+ * otherwise, 0 for none) for each of a few pools, in a small table in its thread cache, so most calls take
+ * no lock. A magazine is taken or given back POOL_BATCH objects at a time under the pool's lock.
+ *
+ * Pool headers are never freed, so a magazine can always look at its pool's header: pb_pool_destroy() clears
+ * the pool's serial, and a magazine whose serial no longer matches is dropped rather than given back. The
+ * headers of destroyed pools are reused by pb_pool_create(). They are kept on the pools list, which
+ * pools_lock guards, and a serial only changes under it or under the pool's lock. A pool's lock nests
+ * outside the arena locks, since chunks are allocated under it.
+ */
+#define POOL_CHUNK KB(64)
+#define POOL_BATCH 16
+
+struct pb_pool {
+  pthread_mutex_t lock;
+  uint64_t        serial;         //nonzero and unique while the pool is live, 0 once destroyed
+  size_t          stride;         //bytes from one object to the next
+  size_t          offset;         //bytes from the start of a chunk to its first object
+  size_t          chunk_size;
+  void*           free_list;      //freed objects, linked through their first word
+  intptr_t        free_ptr;       //next object never given out in the newest chunk
+  intptr_t        end_ptr;        //end of the newest chunk
+  void*           chunks;         //chunks, newest first, linked through their first word
+  struct pb_pool* next;           //next pool header on the pools list
+
+};
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pb_pool_s*      pools;               //every pool header, live or not
+static uint64_t        pool_serial;         //serial of the last pool created
+
+pb_pool_s* pb_pool_create (size_t obj_size, size_t align) {
+
+  if ((align & (align - 1)) != 0 || align > POOL_CHUNK || obj_size > SIZE_MAX / 4) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (align < sizeof(void*)) {
+    align = align == 0 ? ALIGNMENT : sizeof(void*);
+  }
+
+  size_t stride = obj_size == 0 ? align : (obj_size + align - 1) & ~(align - 1);
+  size_t offset = align > 64 ? align : 64;
+  size_t chunk_size = POOL_CHUNK;
+  if (chunk_size < offset + POOL_BATCH * stride) {
+    chunk_size = offset + POOL_BATCH * stride;
+  }
+
+  //claim the header of a destroyed pool, or else make a new one
+  pthread_mutex_lock(&pools_lock);
+  uint64_t   serial = ++pool_serial;
+  pb_pool_s* pool   = pools;
+  while (pool != NULL && __atomic_load_n(&pool -> serial, __ATOMIC_ACQUIRE) != 0) {
+    pool = pool -> next;
+  }
+  if (pool != NULL) {
+    __atomic_store_n(&pool -> serial, serial, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&pools_lock);
+
+  if (pool == NULL) {
+    pool = aligned_alloc(64, (sizeof(pb_pool_s) + 63) & ~(size_t)63);
+    if (pool == NULL) {
+      return NULL;
+    }
+    pthread_mutex_init(&pool -> lock, NULL);
+    pool -> serial = serial;
+    pthread_mutex_lock(&pools_lock);
+    pool -> next = pools;
+    pools        = pool;
+    pthread_mutex_unlock(&pools_lock);
+  }
+
+  pthread_mutex_lock(&pool -> lock);
+  pool -> stride     = stride;
+  pool -> offset     = offset;
+  pool -> chunk_size = chunk_size;
+  pool -> free_list  = NULL;
+  pool -> free_ptr   = 0;
+  pool -> end_ptr    = 0;
+  pool -> chunks     = NULL;
+  pthread_mutex_unlock(&pool -> lock);
+
+  return pool;
+}
+
+//takes up to (count) objects of (pool) and links them into a list at (head). The caller holds the pool's lock.
+//Returns how many it took, fewer than (count) only if no chunk could be allocated.
+static unsigned pool_take (pb_pool_s* pool, void** head, unsigned count) {
+
+  unsigned taken = 0;
+  while (taken < count && pool -> free_list != NULL) {
+    void* ptr = pool -> free_list;
+    pool -> free_list = *(void**) ptr;
+    *(void**) ptr = *head;
+    *head = ptr;
+    taken += 1;
+  }
+
+  while (taken < count) {
+    if ((size_t) (pool -> end_ptr - pool -> free_ptr) < pool -> stride) {
+      void* chunk = aligned_alloc(pool -> offset, pool -> chunk_size);
+      if (chunk == NULL) {
+        break;
+      }
+      *(void**) chunk = pool -> chunks;
+      pool -> chunks   = chunk;
+      pool -> free_ptr = (intptr_t) chunk + pool -> offset;
+      pool -> end_ptr  = (intptr_t) chunk + pool -> chunk_size;
+    }
+
+    void* ptr = (void*) pool -> free_ptr;
+    pool -> free_ptr += pool -> stride;
+    *(void**) ptr = *head;
+    *head = ptr;
+    taken += 1;
+  }
+
+  return taken;
+}
+
+//gives the (count) objects of (magazine) back to its pool, or drops them if the pool was destroyed since the
+//magazine was filled, and empties it
+static void pool_magazine_flush (pool_magazine_s* magazine) {
+
+  pb_pool_s* pool = magazine -> pool;
+  if (pool != NULL && magazine -> head != NULL) {
+    pthread_mutex_lock(&pool -> lock);
+    if (__atomic_load_n(&pool -> serial, __ATOMIC_ACQUIRE) == magazine -> serial) {
+      void* tail = magazine -> head;
+      while (*(void**) tail != NULL) {
+        tail = *(void**) tail;
+      }
+      *(void**) tail    = pool -> free_list;
+      pool -> free_list = magazine -> head;
+    }
+    pthread_mutex_unlock(&pool -> lock);
+  }
+
+  magazine -> head  = NULL;
+  magazine -> count = 0;
+}
+
+//returns every magazine of (cache) to its pool when the thread exits
+static void pool_magazines_flush (tcache_s* cache) {
+  for (unsigned i = 0; i < POOL_MAGAZINES; i += 1) {
+    pool_magazine_flush(&cache -> magazines[i]);
+    cache -> magazines[i].pool = NULL;
+  }
+}
+
+//returns the calling thread's magazine for (pool), taking over its slot from whichever pool held it. Returns
+//NULL when the thread has no magazines.
+static inline pool_magazine_s* pool_magazine (pb_pool_s* pool) {
+
+  tcache_s* cache = &tcache;
+  if (POOL_MAGAZINE == 0 || cache -> dead) {
+    return NULL;
+  }
+
+  uint64_t         serial   = __atomic_load_n(&pool -> serial, __ATOMIC_RELAXED);
+  pool_magazine_s* magazine = &cache -> magazines[serial % POOL_MAGAZINES];
+  if (__builtin_expect(magazine -> pool != pool || magazine -> serial != serial, 0)) {
+    pool_magazine_flush(magazine);
+    magazine -> pool   = pool;
+    magazine -> serial = serial;
+    if (cache -> limit == 0 && tcache_register(cache) == NULL) {
+      return NULL;
+    }
+  }
+  return magazine;
+}
+
+void* pb_pool_alloc (pb_pool_s* pool) {
+
+  pool_magazine_s* magazine = pool_magazine(pool);
+  void*            ptr;
+
+  if (magazine != NULL && magazine -> head != NULL) {
+    ptr = magazine -> head;
+    magazine -> head   = *(void**) ptr;
+    magazine -> count -= 1;
+    return ptr;
+  }
+
+  ptr = NULL;
+  pthread_mutex_lock(&pool -> lock);
+  if (magazine == NULL) {
+    pool_take(pool, &ptr, 1);
+  } else {
+    unsigned taken = pool_take(pool, &ptr, POOL_BATCH);
+    if (taken != 0) {
+      magazine -> head  = *(void**) ptr;
+      magazine -> count = taken - 1;
+    }
+  }
+  pthread_mutex_unlock(&pool -> lock);
+
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+void pb_pool_free (pb_pool_s* pool, void* ptr) {
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  pool_magazine_s* magazine = pool_magazine(pool);
+  if (magazine != NULL && magazine -> count < POOL_MAGAZINE) {
+    *(void**) ptr = magazine -> head;
+    magazine -> head   = ptr;
+    magazine -> count += 1;
+    return;
+  }
+
+  pthread_mutex_lock(&pool -> lock);
+  *(void**) ptr = pool -> free_list;
+  pool -> free_list = ptr;
+
+  //hand back all but half a batch of a full magazine, so alternating calls do not take the lock every time
+  if (magazine != NULL) {
+    while (magazine -> count > POOL_BATCH / 2) {
+      void* next = magazine -> head;
+      magazine -> head  = *(void**) next;
+      *(void**) next    = pool -> free_list;
+      pool -> free_list = next;
+      magazine -> count -= 1;
+    }
+  }
+  pthread_mutex_unlock(&pool -> lock);
+}
+
+void pb_pool_destroy (pb_pool_s* pool) {
+
+  if (pool == NULL) {
+    return;
+  }
+
+  //the calling thread's magazine can go right away; the others are dropped when their threads next look
+  pool_magazine_s* magazine = &tcache.magazines[pool -> serial % POOL_MAGAZINES];
+  if (magazine -> pool == pool && magazine -> serial == pool -> serial) {
+    magazine -> pool  = NULL;
+    magazine -> head  = NULL;
+    magazine -> count = 0;
+  }
+
+  pthread_mutex_lock(&pool -> lock);
+  void* chunk = pool -> chunks;
+  pool -> chunks    = NULL;
+  pool -> free_list = NULL;
+  pool -> free_ptr  = 0;
+  pool -> end_ptr   = 0;
+  __atomic_store_n(&pool -> serial, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pool -> lock);
+
+  while (chunk != NULL) {
+    void* next = *(void**) chunk;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+
+/*
+ * malloc_trim releases free memory back to the OS right away. It empties the calling thread's cache into its
+ * arena, then runs a purge pass over every arena, leaving (pad) bytes above each bump frontier untouched.
+ * Returns 1 if any memory was released and 0 otherwise, like glibc's malloc_trim().
+ */
+int malloc_trim (size_t pad) {
+
+  tcache_s* cache    = &tcache;
+  size_t    released = 0;
+
+  for (unsigned i = 0; i < MAX_ARENAS; i += 1) {
+    arena_s* arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+    if (arena == NULL) {
+      continue;
+    }
+
+    pthread_mutex_lock(&arena -> lock);
+    remote_free_drain_all(arena);
+    if (arena == cache -> arena) {
+      tcache_flush(cache);
+    }
+    released += arena_purge(arena, pad, MADV_DONTNEED);
+    pthread_mutex_unlock(&arena -> lock);
+  }
+
+  return released != 0;
+
+} // malloc_trim()
+
+
+/*
+ * Configuration. PB_MALLOC_CONF holds options as name:value pairs separated by commas, for example
+ * PB_MALLOC_CONF=narenas:4,tcache_max:8,hugepages:thp. init() reads it once, when the first thread sets up its
+ * cache, and pb_mallctl() reads and changes the same options at run time:
+ *
+ *   narenas          arenas to use, 1 to MAX_ARENAS, rounded up to a multiple of the NUMA nodes (one per CPU)
+ *   numa             0 keeps every arena on node 0's policy, like PB_NUMA=0 (1)
+ *   fit              placement policy of first-fit builds, 0 or first, 1 or best, like PB_FIT (first)
+ *   tcache_max       blocks a thread caches per size class, 0 to TCACHE_LIMIT; 0 turns the caches off (32)
+ *   mmap_threshold   bytes from which a block gets a mapping of its own, above SMALL_MAX (PB_MMAP_THRESHOLD)
+ *   purge_decay_ms   ms between amortized purge passes, negative for none (PB_PURGE_DECAY_MS)
+ *   hugepages        0 or off, 1 or thp, 2 or hugetlb, like PB_HUGEPAGES (off)
+ *   segment_size     SEGMENT_SIZE, which can only be read: free() masks addresses with it (PB_SEGMENT_SIZE)
+ *
+ * Sizes take a k, m or g suffix. narenas, numa and fit only take effect in PB_MALLOC_CONF, since they are
+ * fixed once the first arena is set up. A new tcache_max applies to the calling thread and the threads that
+ * set up their cache later, and hugepages to segments mapped later. Reading numa tells whether the arenas are
+ * really split over more than one node. pb_mallctl() also runs two commands:
+ * "flush" gives the calling thread's cached blocks and pool objects back, and "trim" runs malloc_trim(0).
+ */
+
+//checks that (value) lies in [lowest, highest]. Returns 0, or -1 with errno set to EINVAL.
+static int option_range (long value, long lowest, long highest) {
+  if (value < lowest || value > highest) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+//fails with EPERM unless (startup) is set, for the options that are fixed once the heap is set up
+static int option_fixed (int startup) {
+  if (!startup) {
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+//sets option (name) to (value). Returns 0, or -1 with errno set to EINVAL for an unknown option or a value out
+//of range, or to EPERM for an option that cannot be changed once the heap is set up, which is when (startup)
+//is 0. The caller holds arenas_lock.
+static int option_set (const char* name, long value, int startup) {
+
+  if (strcmp(name, "narenas") == 0) {
+    if (option_range(value, 1, MAX_ARENAS) != 0 || option_fixed(startup) != 0) {
+      return -1;
+    }
+    arenas_wanted = (unsigned) value;
+    return 0;
+  }
+
+  if (strcmp(name, "numa") == 0) {
+    if (option_range(value, 0, 1) != 0 || option_fixed(startup) != 0) {
+      return -1;
+    }
+    numa_wanted = (int) value;
+    return 0;
+  }
 
+  if (strcmp(name, "fit") == 0) {
+    if (option_range(value, FIT_FIRST, FIT_BEST) != 0 || option_fixed(startup) != 0) {
+      return -1;
+    }
+    fit_policy = (int) value;
+    return 0;
+  }
 
+  if (strcmp(name, "tcache_max") == 0) {
+    if (option_range(value, 0, TCACHE_LIMIT) != 0) {
+      return -1;
+    }
+    __atomic_store_n(&tcache_limit, (unsigned) value, __ATOMIC_RELAXED);
+    return 0;
+  }
 
-#define PAGE_SIZE sysconf(_SC_PAGESIZE)
-#define KB(size)  ((size_t)size * 1024)
-#define MB(size)  (KB(size) * 1024)
-#define GB(size)  (MB(size) * 1024)
-#define HEAP_SIZE GB(2)
+  if (strcmp(name, "mmap_threshold") == 0) {
+    if (option_range(value, SMALL_MAX + 1, SEGMENT_SIZE) != 0) {
+      return -1;
+    }
+    __atomic_store_n(&mmap_threshold, (size_t) value, __ATOMIC_RELAXED);
+    return 0;
+  }
 
+  if (strcmp(name, "purge_decay_ms") == 0) {
+    __atomic_store_n(&purge_decay_ms, value, __ATOMIC_RELAXED);
+    return 0;
+  }
 
-static void*    free_ptr  = NULL; 
-static void*	last_unallocated_free_ptr = NULL; 
-static intptr_t start_ptr;
-static intptr_t end_ptr;
+  if (strcmp(name, "hugepages") == 0) {
+    if (option_range(value, HUGE_OFF, SEGMENT_SIZE % HUGE_PAGE_SIZE == 0 ? HUGE_TLB : HUGE_OFF) != 0) {
+      return -1;
+    }
+    __atomic_store_n(&huge_pages, (int) value, __ATOMIC_RELAXED);
+    return 0;
+  }
 
+  errno = strcmp(name, "segment_size") == 0 ? EPERM : EINVAL;
+  return -1;
+}
 
-/* init() initializes a virtual address space with a heap of size HEAP_SIZE. 
- *
- * The call to mmap() maps a virtual address space to physical memory.
- *   
- *   We set the len variable so that the size of our mapping is HEAP_SIZE   
- *   We set the prot parameter so that we can read and write data. 
- *   We include MAP_PRIVATE and MAP_ANONYMOUS flags. MAP_PRIVATE abstracts changes in the mapped data. 
- *   MAP_ANONYMOUS ignores the next parameter, 'fildes'. This means we create a new zeroed region of memory for each call. 
- * 
- * If the mapping is successful, we delimit the start and end of the heap in our address space. 
- */
-void init () {
+//stores the value of option (name) at (value). Returns 0, or -1 with errno set to EINVAL for an unknown option.
+static int option_get (const char* name, long* value) {
+
+  if (strcmp(name, "narenas") == 0) {
+    *value = num_arenas;
+  } else if (strcmp(name, "numa") == 0) {
+    *value = num_nodes > 1;
+  } else if (strcmp(name, "fit") == 0) {
+    *value = fit_policy;
+  } else if (strcmp(name, "tcache_max") == 0) {
+    *value = __atomic_load_n(&tcache_limit, __ATOMIC_RELAXED);
+  } else if (strcmp(name, "mmap_threshold") == 0) {
+    *value = (long) __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+  } else if (strcmp(name, "purge_decay_ms") == 0) {
+    *value = __atomic_load_n(&purge_decay_ms, __ATOMIC_RELAXED);
+  } else if (strcmp(name, "hugepages") == 0) {
+    *value = __atomic_load_n(&huge_pages, __ATOMIC_RELAXED);
+  } else if (strcmp(name, "segment_size") == 0) {
+    *value = (long) SEGMENT_SIZE;
+  } else {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+//values PB_MALLOC_CONF may give by name
+static const struct {
+  const char* option;
+  const char* word;
+  long        value;
 
+} conf_words[] = {
+  { "fit",       "first",   FIT_FIRST },
+  { "fit",       "best",    FIT_BEST },
+  { "hugepages", "off",     HUGE_OFF },
+  { "hugepages", "thp",     HUGE_THP },
+  { "hugepages", "hugetlb", HUGE_TLB },
+};
 
-  if (free_ptr == NULL) {
-    free_ptr = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (free_ptr == MAP_FAILED) {
-      write(STDOUT_FILENO, "mmap failed!\n", 13);
-      exit(1);
+//parses the value of option (name) from (text) up to (end): a name from conf_words, or a decimal number with an
+//optional k, m or g suffix. Returns 0, or -1 if it is neither.
+static int conf_value (const char* name, const char* text, const char* end, long* value) {
+
+  for (size_t i = 0; i < sizeof(conf_words) / sizeof(conf_words[0]); i += 1) {
+    size_t length = strlen(conf_words[i].word);
+    if (strcmp(name, conf_words[i].option) == 0 && (size_t) (end - text) == length && memcmp(text, conf_words[i].word, length) == 0) {
+      *value = conf_words[i].value;
+      return 0;
     }
-    start_ptr = (intptr_t)free_ptr;
-    end_ptr   = start_ptr + HEAP_SIZE;
-    write(STDOUT_FILENO, "pb!\n", 4);
-    fsync(STDOUT_FILENO);
   }
 
+  char* stop;
+  errno  = 0;
+  *value = strtol(text, &stop, 10);
+  if (stop == text || errno != 0) {
+    return -1;
+  }
+
+  unsigned shift = 0;
+  if (stop < end && (*stop == 'k' || *stop == 'm' || *stop == 'g')) {
+    shift = *stop == 'k' ? 10 : *stop == 'm' ? 20 : 30;
+    stop += 1;
+  }
+  if (stop != end || *value > LONG_MAX >> shift || *value < LONG_MIN >> shift) {
+    return -1;
+  }
+  *value *= 1l << shift;
+  return 0;
 }
 
-//link_s is a structure that will let us construct a linked list for the free types. It contains the size of
-//the blocks and the address to the next block. 
+//sets the options in (conf), the value of PB_MALLOC_CONF, and reports the ones it cannot use on stderr. Called
+//by init(), under arenas_lock.
+static void conf_read (const char* conf) {
 
-typedef struct link {
-  size_t size; 
-  struct link* next; 
-  
-} link_s; 
+  while (conf != NULL && *conf != '\0') {
+    const char* end   = strchrnul(conf, ',');
+    const char* colon = memchr(conf, ':', end - conf);
+    char        name[32];
+    long        value;
+
+    if (colon == NULL || (size_t) (colon - conf) >= sizeof(name)) {
+      fd_printf(STDERR_FILENO, "pb-alloc: ignoring PB_MALLOC_CONF option %.*s\n", (int) (end - conf), conf);
+    } else {
+      memcpy(name, conf, colon - conf);
+      name[colon - conf] = '\0';
+      if (conf_value(name, colon + 1, end, &value) != 0 || option_set(name, value, 1) != 0) {
+        fd_printf(STDERR_FILENO, "pb-alloc: ignoring PB_MALLOC_CONF option %.*s\n", (int) (end - conf), conf);
+      }
+    }
+    conf = *end == ',' ? end + 1 : end;
+  }
+}
 
+//gives the calling thread's cached blocks back to its arena. With (pools) set, the objects in its pool
+//magazines go back to their pools as well.
+static void tcache_give_back (tcache_s* cache, int pools) {
 
-//returns true if a free block has no pointer to a next free block
-int  noNext (void* ptr) {
- link_s* block_header = (link_s*) ptr ; 
- if (block_header -> next == NULL) {
-  return 1; 
- } else return 0; 
+  if (cache -> arena != NULL) {
+    pthread_mutex_lock(&cache -> arena -> lock);
+    tcache_flush(cache);
+    pthread_mutex_unlock(&cache -> arena -> lock);
+  }
+  if (pools) {
+    pool_magazines_flush(cache);
+  }
 }
 
+int pb_mallctl (const char* name, long* old_value, const long* new_value) {
+
+  tcache_s* cache = &tcache;
+  long      value = 0;
+  int       result;
+
+  if (name == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (strcmp(name, "flush") == 0) {
+    tcache_give_back(cache, 1);
+  } else if (strcmp(name, "trim") == 0) {
+    value = malloc_trim(0);
+  } else {
+    pthread_mutex_lock(&arenas_lock);
+    init();
+    result = option_get(name, &value);
+    if (result == 0 && new_value != NULL) {
+      result = option_set(name, *new_value, 0);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+
+    if (result != 0) {
+      return -1;
+    }
+
+    if (new_value != NULL && strcmp(name, "tcache_max") == 0 && cache -> arena != NULL && !cache -> dead) {
+      cache -> limit = __atomic_load_n(&tcache_limit, __ATOMIC_RELAXED);
+      if (*new_value < value) {
+        tcache_give_back(cache, 0);
+      }
+    }
+  }
+
+  if (old_value != NULL) {
+    *old_value = value;
+  }
+  return 0;
+
+} // pb_mallctl()
+
+
 /*
- * malloc allocates a block of memory of atleast (size) bytes and returns a pointer to this block
- * malloc will preferentially allocate blocks that were made with free().
-  */
+ * Statistics. Every thread counts its own malloc() and free() calls per size class in its cache, one increment
+ * of thread-local memory per call, and each arena counts how many free blocks its fit searches look at, under
+ * its lock. Everything else is measured only when asked for: mallinfo2() and malloc_stats() walk every segment
+ * of every arena under its lock, so they are slow, but cost nothing until they are called.
+ *
+ * Setting PB_STATS in the environment to anything but 0 prints malloc_stats() to stderr when the program exits.
+ */
+typedef struct heap_stats {
+  size_t   mapped;           //bytes mapped for block and slab segments
+  size_t   in_use;           //bytes in allocated blocks and slab objects, thread caches included
+  size_t   free;             //bytes in free blocks, free slab objects and empty slabs
+  size_t   free_blocks;      //number of free blocks
+  size_t   bump;             //bytes above the bump frontiers, up to the end of their segments
+  uint64_t searches;         //fit searches of the free lists
+  uint64_t search_steps;     //free blocks looked at by those searches
 
-void* malloc (size_t size) {
+} heap_stats_s;
 
-  init();
-  
-  link_s* previous_free_block; 
-  void* new_block_ptr;
-  link_s* free_block_header;  
 
+//adds what (arena) holds to (stats). The caller holds the arena's lock.
+static void arena_stats (arena_s* arena, heap_stats_s* stats) {
 
- //edge case: we have not allocated any blocks or we have no blocks made with free()  
+  for (segment_s* segment = arena -> segments; segment != NULL; segment = segment -> next) {
+    stats -> mapped += segment -> size;
+    stats -> bump   += segment -> end_ptr - (intptr_t) segment -> last_unallocated_free_ptr;
 
-  if (  noNext(free_ptr) ){
-    free_block_header = (link_s*) free_ptr; 
-    free_block_header -> size = size; 
-    free_block_header -> next = NULL; //allocated 
-    
-    new_block_ptr = (void*) ((intptr_t) free_block_header + sizeof(link_s)); //start of the first allocated block
-    
-   
-    last_unallocated_free_ptr =  (void*) ((intptr_t) new_block_ptr + size);
-    free_ptr = last_unallocated_free_ptr;  
-    return new_block_ptr; 
+    for (link_s* block = (link_s*) segment -> start_ptr; (void*) block < segment -> last_unallocated_free_ptr; block = block_after(block)) {
+      if (block_flags(block) != 0) {
+        stats -> in_use += block -> size;
+      } else {
+        stats -> free        += block -> size;
+        stats -> free_blocks += 1;
+      }
+    }
   }
 
+  for (segment_s* segment = arena -> slab_segments; segment != NULL; segment = segment -> next) {
+    slab_segment_s* slabs = (slab_segment_s*) segment;
+    stats -> mapped += segment -> size;
+    stats -> bump   += segment -> end_ptr - (intptr_t) segment -> last_unallocated_free_ptr;
 
-  //find the first fit block by looping through the free block made with free(). s
-  free_block_header = (link_s*) free_ptr;
-  previous_free_block = NULL;
- 
-  while(free_block_header != NULL  && free_block_header != last_unallocated_free_ptr) {
-   
-    size_t free_block_size = free_block_header -> size; 
-
-    if (size <= free_block_size) {
-      new_block_ptr = (void*) ((intptr_t) free_block_header + sizeof(link_s));
-      
-      //nullify ptr to next free block and redirect pointer pointing to this block 
-     
-      //edge case: allocating memory in the first free block in the list  
-      if (previous_free_block == NULL) {
-         free_ptr = (void*) free_block_header -> next; 
+    for (intptr_t page = segment -> start_ptr; (void*) page < segment -> last_unallocated_free_ptr; page += SLAB_SIZE) {
+      size_t index = (page - (intptr_t) segment) / SLAB_SIZE;
+      if (slabs -> free_map[index / 64] >> (index % 64) & 1) {
+        stats -> free += SLAB_SIZE;
       } else {
-         previous_free_block -> next = free_block_header -> next;     
-      } 
-      
-      free_block_header -> next = NULL; //allocated. We don't split freed blocks, so block size is kept the same.
-      return new_block_ptr;  
+        slab_s* slab   = (slab_s*) page;
+        size_t  object = slab_object_size(slab -> size_class);
+        stats -> in_use += slab -> count * object;
+        stats -> free   += (slab -> capacity - slab -> count) * object;
+      }
+    }
+  }
 
-    } else {
-      previous_free_block = free_block_header; 
-      free_block_header = free_block_header -> next; 
-     }   
+  stats -> searches     += arena -> searches;
+  stats -> search_steps += arena -> search_steps;
+}
+
+//adds (from) to (to)
+static void heap_stats_add (heap_stats_s* to, heap_stats_s* from) {
+  to -> mapped       += from -> mapped;
+  to -> in_use       += from -> in_use;
+  to -> free         += from -> free;
+  to -> free_blocks  += from -> free_blocks;
+  to -> bump         += from -> bump;
+  to -> searches     += from -> searches;
+  to -> search_steps += from -> search_steps;
+}
+
+//stores the malloc() and free() counts of every thread in (counters), and returns the number of blocks sitting
+//in thread caches, and their size in bytes at (cached_bytes). The counts of live threads are read without
+//stopping them, so they may be a little behind.
+static size_t counters_collect (counters_s* counters, size_t* cached_bytes) {
+
+  size_t cached = 0;
+  *cached_bytes = 0;
+
+  pthread_mutex_lock(&arenas_lock);
+  *counters = retired_counters;
+  for (tcache_s* cache = tcaches; cache != NULL; cache = cache -> next) {
+    for (size_t index = 0; index < COUNTER_CLASSES; index += 1) {
+      counters -> mallocs[index] += cache -> counters.mallocs[index];
+      counters -> frees[index]   += cache -> counters.frees[index];
+    }
+    for (size_t index = 0; index < NUM_SIZE_CLASSES; index += 1) {
+      cached        += cache -> counts[index];
+      *cached_bytes += cache -> counts[index] * (index + 1) * ALIGNMENT;
+    }
   }
+  pthread_mutex_unlock(&arenas_lock);
 
-  //None of the blocks made with free() are large enough for allocation. So we allocate
-  //in the space between the last allocated block and the end of the heap.
-  free_block_header = (link_s*) last_unallocated_free_ptr; 
-  free_block_header -> size = size; 
-  free_block_header -> next = NULL; 
+  return cached;
+}
 
-  new_block_ptr = (void*) ((intptr_t) free_block_header + sizeof(link_s));
-  last_unallocated_free_ptr = (void*) (intptr_t)new_block_ptr + size; 
-  
-  previous_free_block -> next = NULL; 
+//adds up every arena into (stats)
+static void heap_stats_collect (heap_stats_s* stats) {
 
-  return new_block_ptr;  
+  for (unsigned i = 0; i < MAX_ARENAS; i += 1) {
+    arena_s* arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+    if (arena == NULL) {
+      continue;
+    }
 
-     
-} // malloc()
+    pthread_mutex_lock(&arena -> lock);
+    remote_free_drain_all(arena);
+    arena_stats(arena, stats);
+    pthread_mutex_unlock(&arena -> lock);
+  }
+}
 
 
-//free takes a ptr to an allocated block (not its header) and deallocates it. We mark it as free, and add a pointer from the previous free block 
-void free (void* ptr) {
- 
-  
-//  intptr_t*  head_addr = (intptr_t) - sizeof(size_t)  //address of header start 
-  link_s* new_link_ptr = (link_s*) ((intptr_t)ptr- sizeof(link_s)); 
-  
-  //add this address of this now free block to the start of the list of free points 
-  new_link_ptr -> next = (link_s*) free_ptr; 
-  free_ptr = new_link_ptr;  
-   
-  
-} // free()
+/*
+ * mallinfo2 reports the heap like glibc's does. arena is the memory mapped for arenas and hblkhd the memory
+ * in large mappings. uordblks and fordblks split the arena memory into what the program holds and what is free
+ * or never used, and keepcost is the part of that above the bump frontiers. smblks and fsmblks count the
+ * blocks sitting in thread caches, which are not part of uordblks.
+ */
+struct mallinfo2 mallinfo2 () {
+
+  struct mallinfo2 info;
+  heap_stats_s     stats = { 0 };
+  counters_s       counters;
+  size_t           cached_bytes;
+  size_t           cached = counters_collect(&counters, &cached_bytes);
+
+  heap_stats_collect(&stats);
+
+  memset(&info, 0, sizeof(info));
+  info.arena    = stats.mapped;
+  info.ordblks  = stats.free_blocks;
+  info.smblks   = cached;
+  info.hblks    = __atomic_load_n(&large_count, __ATOMIC_RELAXED);
+  info.hblkhd   = __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+  info.fsmblks  = cached_bytes;
+  info.uordblks = stats.in_use > cached_bytes ? stats.in_use - cached_bytes : 0;
+  info.fordblks = stats.free + stats.bump;
+  info.keepcost = stats.bump;
+
+  return info;
+
+} // mallinfo2()
+
+
+/*
+ * malloc_stats prints a report to stderr: one line per arena with its memory and the position of its bump
+ * frontier in the current segment, the totals with the fragmentation ratio (free bytes over free and used
+ * bytes, not counting the bump regions) and the average fit search length, then the malloc() and free()
+ * counts of every size class that was used. It writes with fd_printf(), which allocates nothing.
+ */
+void malloc_stats () {
+
+  heap_stats_s total = { 0 };
+  counters_s   counters;
+  size_t       cached_bytes;
+  size_t       cached = counters_collect(&counters, &cached_bytes);
+
+  for (unsigned i = 0; i < MAX_ARENAS; i += 1) {
+    arena_s* arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+    if (arena == NULL) {
+      continue;
+    }
+
+    heap_stats_s stats = { 0 };
+
+    pthread_mutex_lock(&arena -> lock);
+    remote_free_drain_all(arena);
+    arena_stats(arena, &stats);
+    segment_s* segment  = arena -> segment;
+    size_t     frontier = (intptr_t) segment -> last_unallocated_free_ptr - (intptr_t) segment;
+    pthread_mutex_unlock(&arena -> lock);
+
+    fd_printf(STDERR_FILENO, "arena %u (node %u): %zu bytes mapped, %zu in use, %zu free in %zu blocks, bump frontier at %zu of %zu\n",
+            i, arena -> node, stats.mapped, stats.in_use, stats.free, stats.free_blocks, frontier, segment -> size);
+    heap_stats_add(&total, &stats);
+  }
+
+  size_t used = total.in_use + total.free;
+  fd_printf(STDERR_FILENO, "total: %zu bytes mapped, %zu in use, %zu free, %zu above bump frontiers\n",
+          total.mapped, total.in_use, total.free, total.bump);
+  fd_printf(STDERR_FILENO, "thread caches: %zu blocks, %zu bytes\n", cached, cached_bytes);
+  fd_printf(STDERR_FILENO, "large mappings: %zu, %zu bytes\n",
+          __atomic_load_n(&large_count, __ATOMIC_RELAXED), __atomic_load_n(&large_bytes, __ATOMIC_RELAXED));
+  fd_printf(STDERR_FILENO, "fragmentation: %.1f%%\n", used == 0 ? 0.0 : 100.0 * total.free / used);
+  fd_printf(STDERR_FILENO, "fit searches: %llu, %.1f blocks looked at on average\n", (unsigned long long) total.searches,
+          total.searches == 0 ? 0.0 : (double) total.search_steps / total.searches);
+
+  for (size_t index = 0; index < COUNTER_CLASSES; index += 1) {
+    if (counters.mallocs[index] == 0 && counters.frees[index] == 0) {
+      continue;
+    }
+    if (index < NUM_SIZE_CLASSES) {
+      fd_printf(STDERR_FILENO, "size %5zu: %llu mallocs, %llu frees\n", (index + 1) * ALIGNMENT,
+              (unsigned long long) counters.mallocs[index], (unsigned long long) counters.frees[index]);
+    } else {
+      fd_printf(STDERR_FILENO, "larger:     %llu mallocs, %llu frees\n",
+              (unsigned long long) counters.mallocs[index], (unsigned long long) counters.frees[index]);
+    }
+  }
+
+} // malloc_stats()
+
+
+//prints malloc_stats() at exit when PB_STATS asks for it
+__attribute__ ((destructor)) static void stats_dump_at_exit () {
+  if (stats_at_exit) {
+    malloc_stats();
+  }
+}
 
 
 /*
  * calloc allocates and zeroes a block of nmemb * size bytes and returns a pointer to this block. 
  * 
- * We calculate (nmemb * size), and use malloc to allocate 
+ * We calculate (nmemb * size), failing with ENOMEM if it overflows, and allocate
  * a block of memory of that size. new_block_ptr points to the start of that block.
  * 
- * bzero() writes (nmemb*size) bytes of value 0 in the memory location that start at the block pointer.
- * 
+ * bzero() writes 0 over the part of the block that may hold old data. Small blocks come from the thread cache
+ * and are always cleared. Large blocks are fresh mappings and never need it. Other blocks carved from fresh
+ * memory at the bump frontier only need clearing up to the segment's high_water mark, so a big calloc() does
+ * not fault in and write every page ahead of the caller. Blocks sampled by the heap profiler are always cleared.
  */ 
 void* calloc (size_t nmemb, size_t size) {
 
-  size_t block_size    = nmemb * size;
-  void*  new_block_ptr = malloc(block_size);
-  assert(new_block_ptr != NULL);
-  bzero(new_block_ptr, block_size);
+  size_t block_size;
+  void*  new_block_ptr;
+
+  if (TRACING()) {
+    return trace_calloc(nmemb, size);
+  }
+
+  if (__builtin_mul_overflow(nmemb, size, &block_size) || block_size > SIZE_MAX / 2) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t aligned_size = align_size(block_size);
+  size_t stale        = block_size;
+
+  if (aligned_size <= SMALL_MAX) {
+    new_block_ptr = malloc(block_size);
+  } else if (__builtin_expect(tcache.internal, 0)) {
+    return internal_malloc(aligned_size, ALIGNMENT);      //a fresh mapping is zero already
+  } else {
+    arena_s* arena = tcache_register(&tcache);
+    if (arena == NULL) {
+      return NULL;
+    }
+
+    tcache.counters.mallocs[NUM_SIZE_CLASSES] += 1;
+
+    if (__builtin_expect((tcache.sample_left -= (int64_t) aligned_size) < 0, 0)) {
+      new_block_ptr = prof_malloc(aligned_size);
+    } else if (aligned_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) || aligned_size > SEGMENT_MAX_BLOCK) {
+      return large_alloc(arena, aligned_size, ALIGNMENT);
+    } else {
+      pthread_mutex_lock(&arena -> lock);
+      remote_free_drain(arena);
+      new_block_ptr = heap_alloc(arena, aligned_size, &stale);
+      pthread_mutex_unlock(&arena -> lock);
+    }
+  }
+
+  if (new_block_ptr == NULL) {
+    return NULL;
+  }
+  bzero(new_block_ptr, stale < block_size ? stale : block_size);
 
   return new_block_ptr;
   
@@ -191,15 +3719,20 @@ void* calloc (size_t nmemb, size_t size) {
 
 
 /*
- * realloc resizes the block at the address of ptr. This version of realloc only 
- * increases the size of the block. 
+ * realloc resizes the block at the address of ptr. 
  * 
- * memcpy copies block_size bytes from the old block pointer to the new block pointer.  
- * We deallocate the old block (if we had a working deallocator), and return the new block pointer, which points
- * to a memory block with the larger size. 
+ * Blocks in an arena are resized in place whenever heap_resize() can do it, under the lock of the arena that
+ * owns the block. Slab objects only stay put when the size keeps their size class. Large blocks stay mapped and
+ * are resized with mremap(). Blocks sampled by the heap profiler always move. Otherwise, we allocate a new block
+ * and memcpy copies the smaller of the old and new sizes from the old block pointer to the new block pointer. We
+ * deallocate the old block, and return the new block pointer.
  */
 void* realloc (void* ptr, size_t size) {
 
+  if (TRACING()) {
+    return trace_realloc(ptr, size);
+  }
+
   if (ptr == NULL) {
     return malloc(size);
   }
@@ -209,16 +3742,46 @@ void* realloc (void* ptr, size_t size) {
     return NULL;
   }
 
-  size_t* header_ptr = (size_t*)((intptr_t)ptr - sizeof(size_t));
-  size_t  block_size = *header_ptr;
+  if (size > SIZE_MAX / 2) {
+    errno = ENOMEM;
+    return NULL;
+  }
 
-  if (size <= block_size) {
-    return ptr;
+  segment_s* segment = segment_of(ptr);
+  harden_check(ptr, segment);
+
+  size_t     block_size = usable_size(ptr);
+  int        sampled    = segment -> kind != SEGMENT_SLABS && (block_header(ptr) -> tag & BLOCK_SAMPLED);
+  size_t     threshold  = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+
+  if (sampled) {
+    //always moved, so that free() drops the sample
+  } else if (segment -> kind == SEGMENT_LARGE) {
+    if (size >= threshold) {
+      return large_realloc(segment, size);
+    }
+  } else if (segment -> kind == SEGMENT_SLABS) {
+    if (align_size(size) == block_size) {
+      return ptr;                          //moved otherwise, so the object keeps the class free_sized() expects
+    }
+  } else if (size < threshold) {
+    arena_s* arena = segment -> arena;
+    int      resized;
+
+    pthread_mutex_lock(&arena -> lock);
+    resized = heap_resize(arena, block_header(ptr), align_size(size));
+    pthread_mutex_unlock(&arena -> lock);
+
+    if (resized) {
+      return ptr;
+    }
   }
 
   void* new_block_ptr = malloc(size);
-  assert(new_block_ptr != NULL);
-  memcpy(new_block_ptr, ptr, block_size);
+  if (new_block_ptr == NULL) {
+    return NULL;
+  }
+  memcpy(new_block_ptr, ptr, size < block_size ? size : block_size);
   free(ptr);
     
   return new_block_ptr;
@@ -227,6 +3790,185 @@ void* realloc (void* ptr, size_t size) {
 
 
 
+/*
+ * Aligned allocation. Every block is aligned to ALIGNMENT already, so smaller alignments are plain malloc()
+ * calls. Anything stricter is carved out of the arena by heap_alloc_aligned(), or for large blocks, placed at
+ * an aligned offset inside its own mapping. Alignments of SEGMENT_SIZE or more cannot be served, because
+ * free() finds a block's segment by rounding its address down to SEGMENT_SIZE.
+ *
+ * aligned_malloc takes a power of two (alignment) and returns NULL with errno set on failure.
+ */
+static void* aligned_malloc (size_t alignment, size_t size) {
+
+  void* new_block_ptr;
+
+  if (TRACING()) {
+    return trace_aligned_malloc(alignment, size);
+  }
+
+  if (alignment <= ALIGNMENT) {
+    return malloc(size);
+  }
+
+  if (alignment >= SEGMENT_SIZE || size > SIZE_MAX / 2) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size = align_size(size);
+
+  if (__builtin_expect(tcache.internal, 0)) {
+    return internal_malloc(size, alignment);
+  }
+
+  arena_s* arena = tcache_register(&tcache);
+  if (arena == NULL) {
+    return NULL;
+  }
+
+  tcache.counters.mallocs[counter_class(size)] += 1;
+
+  size_t request = size + alignment + BLOCK_OVERHEAD + MIN_SPLIT;
+  if (request >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) || request > SEGMENT_MAX_BLOCK) {
+    return large_alloc(arena, size, alignment);
+  }
+
+  pthread_mutex_lock(&arena -> lock);
+  remote_free_drain(arena);
+  new_block_ptr = heap_alloc_aligned(arena, size, alignment);
+  pthread_mutex_unlock(&arena -> lock);
+
+  return new_block_ptr;
+
+} // aligned_malloc()
+
+
+//posix_memalign stores a block of (size) bytes aligned to (alignment) at (memptr). (alignment) must be a power
+//of two and a multiple of sizeof(void*). Returns 0, EINVAL or ENOMEM, and leaves errno alone.
+int posix_memalign (void** memptr, size_t alignment, size_t size) {
+
+  if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+
+  int   saved_errno   = errno;
+  void* new_block_ptr = aligned_malloc(alignment, size);
+  if (new_block_ptr == NULL) {
+    int error = errno;
+    errno = saved_errno;
+    return error;
+  }
+
+  *memptr = new_block_ptr;
+  return 0;
+}
+
+//aligned_alloc returns a block of (size) bytes aligned to (alignment), which must be a power of two
+void* aligned_alloc (size_t alignment, size_t size) {
+
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return aligned_malloc(alignment, size);
+}
+
+//memalign is the obsolete form of aligned_alloc. Like glibc, it rounds (alignment) up to a power of two.
+void* memalign (size_t alignment, size_t size) {
+
+  if (alignment > SIZE_MAX / 2 + 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  while ((alignment & (alignment - 1)) != 0) {
+    alignment = (alignment | (alignment - 1)) + 1;
+  }
+
+  return aligned_malloc(alignment, size);
+}
+
+//valloc returns a page-aligned block of (size) bytes
+void* valloc (size_t size) {
+  return aligned_malloc(PAGE_SIZE, size);
+}
+
+//pvalloc returns a page-aligned block of (size) bytes rounded up to whole pages
+void* pvalloc (size_t size) {
+
+  if (size > SIZE_MAX / 2) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t page_size = PAGE_SIZE;
+  return aligned_malloc(page_size, size == 0 ? page_size : (size + page_size - 1) & ~(page_size - 1));
+}
+
+
+//malloc_usable_size returns how many bytes the caller may use in the block at (ptr), 0 for NULL
+size_t malloc_usable_size (void* ptr) {
+  return ptr == NULL ? 0 : usable_size(ptr);
+}
+
+
+/*
+ * fork(). Only the calling thread survives into the child, so a lock another thread held across fork() would
+ * stay locked there for good. fork_prepare() takes every lock of the allocator before fork() and the handlers
+ * after it give them back, in the parent and the child alike, so the child starts with a consistent heap.
+ * The locks are taken in the order the rest of the allocator nests them: pools_lock, the pools, arenas_lock,
+ * the arenas by index, prof_lock, then trace_lock.
+ *
+ * The child drops the trace events buffered at fork(), which the parent writes out itself.
+ */
+static void fork_prepare () {
+
+  pthread_mutex_lock(&pools_lock);
+  for (pb_pool_s* pool = pools; pool != NULL; pool = pool -> next) {
+    pthread_mutex_lock(&pool -> lock);
+  }
+  pthread_mutex_lock(&arenas_lock);
+  for (unsigned i = 0; i < MAX_ARENAS; i += 1) {
+    if (arenas[i] != NULL) {
+      pthread_mutex_lock(&arenas[i] -> lock);
+    }
+  }
+  pthread_mutex_lock(&prof_lock);
+  pthread_mutex_lock(&trace_lock);
+}
+
+static void fork_parent () {
+
+  pthread_mutex_unlock(&trace_lock);
+  pthread_mutex_unlock(&prof_lock);
+  for (unsigned i = MAX_ARENAS; i-- > 0;) {
+    if (arenas[i] != NULL) {
+      pthread_mutex_unlock(&arenas[i] -> lock);
+    }
+  }
+  pthread_mutex_unlock(&arenas_lock);
+  for (pb_pool_s* pool = pools; pool != NULL; pool = pool -> next) {
+    pthread_mutex_unlock(&pool -> lock);
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+static void fork_child () {
+
+  for (tcache_s* cache = tcaches; cache != NULL; cache = cache -> next) {
+    cache -> trace_count = 0;
+  }
+  fork_parent();
+}
+
+//registers the fork() handlers when the library is loaded, since pthread_atfork() may allocate
+__attribute__ ((constructor)) static void fork_handlers_install () {
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+
+
 #if !defined (PB_NO_MAIN)
 void main () {
   int size = 8; 
@@ -254,14 +3996,14 @@ void main () {
  free(b);
  int* c = (int*)malloc(size5*sizeof(int)); 
  int* d = (int*)malloc(size3*sizeof(int)); 
+ assert(d == b); //the thread cache hands back the most recently freed block of a size class
 
- //More test cases: Free the blocks (z, c, d, x) in that order. Allocate 2 blocks of size5 -- malloc(512). Call them 
+ //More test cases: Free the blocks (z, c, d, x) in that order. Allocate 2 blocks of size5 -- malloc(256). Call them 
  //e and f. Allocate one large block, h of size 256 -- malloc(1024). 
- //We expect e to be allocated to address of d
- //f to be allocated to address of c. 
- //Since this is first fit (and we don't change the size of freed blocks, since we don't split freed blocks). 
- //
- //None of the freed blocks will fit h, so we expect it to go at the end. 
+ //Every one of these is small enough for the thread cache, so freeing only pushes the blocks onto the
+ //cache stack of their size class. We expect e to be allocated to the address of c, and f to another
+ //256-byte block from the batch that was fetched for c. Nothing of size 1024 has been freed, so
+ //h is carved from the bump frontier after everything else. 
  free(z); //128
  free(c); //64
  free(d); //128
@@ -269,6 +4011,7 @@ void main () {
 
  int* e = (int*)malloc(size5*sizeof(int)); 
  int* f = (int*)malloc(size5*sizeof(int)); 
+ assert(e == c && f != c); 
  
  int size6 = 256; 
  int* h = (int*)malloc(size6*sizeof(int)); 
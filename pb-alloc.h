@@ -0,0 +1,105 @@
+/**
+ * pb-alloc.h
+ *
+ * Extensions of the pb-alloc allocator beyond the standard malloc() family, which programs linked against
+ * (or preloaded with) pb-alloc can call.
+ **/
+
+#ifndef PB_ALLOC_H
+#define PB_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//free_sized() and free_aligned_sized() of C23: free the block at (ptr), which was asked for with (size) bytes,
+//and (alignment). Small blocks go back to the thread cache without reading a header. (size) must be the size
+//given to the malloc(), calloc() (nmemb * size), realloc() or aligned_alloc() call that returned (ptr).
+void free_sized (void* ptr, size_t size);
+void free_aligned_sized (void* ptr, size_t alignment, size_t size);
+
+//allocates up to (count) blocks of (size) bytes into (out) in one call. Returns how many it allocated, with
+//errno set to ENOMEM when that is fewer than (count). Each block is freed with free() or pb_free_batch().
+size_t pb_malloc_batch (size_t size, size_t count, void** out);
+
+//frees the (count) blocks at (ptrs) in one call. NULL entries are skipped.
+void pb_free_batch (void** ptrs, size_t count);
+
+//regions: pb_region_alloc() bumps through chunks the region gets from malloc(), (chunk_size) bytes at first
+//or 64 KB when it is 0, and returns blocks aligned like malloc()'s without any per-block overhead. The
+//blocks cannot be freed one by one: pb_region_reset() frees them all and keeps the region's largest chunk
+//for the next round, and pb_region_destroy() frees them with the region. A region is not locked, so only one
+//thread at a time may use it.
+typedef struct pb_region pb_region_s;
+
+pb_region_s* pb_region_create (size_t chunk_size);
+void*        pb_region_alloc (pb_region_s* region, size_t size);
+void         pb_region_reset (pb_region_s* region);
+void         pb_region_destroy (pb_region_s* region);
+
+//object pools: pb_pool_alloc() returns an object of the (obj_size) bytes the pool was created with, aligned to
+//(align), a power of two up to 64 KB, or like malloc() when it is 0. Objects have no header and come from
+//chunks the pool gets from the heap; each thread keeps a few free objects of its own, so most calls take no
+//lock. pb_pool_free() takes an object of the pool back, from any thread, and pb_pool_destroy() frees them all
+//at once, after which no thread may use the pool. pb_pool_create() returns NULL with errno set on failure.
+typedef struct pb_pool pb_pool_s;
+
+pb_pool_s* pb_pool_create (size_t obj_size, size_t align);
+void*      pb_pool_alloc (pb_pool_s* pool);
+void       pb_pool_free (pb_pool_s* pool, void* ptr);
+void       pb_pool_destroy (pb_pool_s* pool);
+
+//reads and changes the allocator's options at run time. (name) is one of the options PB_MALLOC_CONF takes:
+//narenas, numa, fit, tcache_max, mmap_threshold, purge_decay_ms, hugepages and segment_size. Its value is
+//stored at (old_value) when that is not NULL, and then set from (new_value) when that is not NULL. Named values
+//are numbers here: fit is 0 for first and 1 for best, hugepages 0 for off, 1 for thp and 2 for hugetlb. The
+//commands "flush", which gives the calling thread's cached blocks back, and "trim", which runs malloc_trim(0)
+//and stores its result at (old_value), take no value. Returns 0, or -1 with errno set to EINVAL for an unknown
+//name or a value out of range, or to EPERM for an option that is fixed once the heap is set up (narenas, numa,
+//fit and segment_size).
+int pb_mallctl (const char* name, long* old_value, const long* new_value);
+
+//writes the live heap profile samples to the file at (path) in the pprof heap profile format. Sampling is on
+//when PB_PROF_SAMPLE holds the mean number of bytes between samples. Returns 0, or -1 with errno set.
+int pb_prof_dump (const char* path);
+
+
+/*
+ * Allocation traces. Setting PB_TRACE to a file name makes pb-alloc log every call of the malloc() family to
+ * that file: a pb_trace_header_s followed by pb_trace_event_s records. Every thread buffers its own events, so
+ * records of different threads are interleaved in chunks and are put back in order by their time. pb-replay
+ * runs a trace against any build of the allocator.
+ */
+#define PB_TRACE_MAGIC "pbtrace1"
+
+#define PB_TRACE_MALLOC   1
+#define PB_TRACE_FREE     2
+#define PB_TRACE_CALLOC   3
+#define PB_TRACE_REALLOC  4
+#define PB_TRACE_MEMALIGN 5
+
+typedef struct pb_trace_header {
+  char     magic[8];              //PB_TRACE_MAGIC, without its NUL
+  uint32_t event_size;            //sizeof(pb_trace_event_s)
+  uint32_t reserved;
+
+} pb_trace_header_s;
+
+typedef struct pb_trace_event {
+  uint64_t time;                  //CLOCK_MONOTONIC time of the call, in ns
+  uint64_t ptr;                   //block returned, or passed to free(); 0 when an allocation failed
+  uint64_t arg;                   //block passed to realloc(), or the alignment asked of memalign()
+  uint64_t size;                  //bytes asked for, nmemb * size for calloc()
+  uint32_t thread;                //calling thread, numbered from 1 in the order threads first allocate
+  uint32_t op;                    //one of PB_TRACE_*
+
+} pb_trace_event_s;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,463 @@
+/**
+ * pb-bench.c
+ *
+ * Microbenchmarks for malloc(), free() and realloc(). Each test reports its throughput, the p50, p99 and p999
+ * latency of single calls and the peak RSS it reached. Build it once against pb-alloc and once against the
+ * system allocator to compare the two:
+ *
+ *   gcc -std=gnu99 -O2 -pthread -fno-builtin -DPB_NO_MAIN -o pb-bench pb-bench.c pb-alloc.c
+ *   gcc -std=gnu99 -O2 -pthread -fno-builtin -DPB_NO_MAIN -DPB_FIRST_FIT -o pb-bench-ff pb-bench.c pb-alloc.c
+ *   gcc -std=gnu99 -O2 -pthread -o pb-bench-libc pb-bench.c
+ *
+ * make bench runs it against the normal and the hardened (-DPB_HARDEN) build in turn, which is how the cost of
+ * the hardening checks is measured.
+ *
+ * usage: pb-bench [-t threads] [-n operations] [test ...]
+ **/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "pb-hist.h"
+
+
+
+/*
+ * Timed calls. Call times go into the latency histograms of pb-hist.h; every thread fills its own and they are
+ * merged at the end of a test.
+ */
+//times one malloc() into (hist)
+static inline void* timed_malloc (hist_s* hist, size_t size) {
+  uint64_t start = now_ns();
+  void*    ptr   = malloc(size);
+  hist_add(hist, now_ns() - start);
+  return ptr;
+}
+
+//times one free() into (hist)
+static inline void timed_free (hist_s* hist, void* ptr) {
+  uint64_t start = now_ns();
+  free(ptr);
+  hist_add(hist, now_ns() - start);
+}
+
+
+//a small xorshift generator per thread, so the tests do not share (or lock) the C library's
+static inline uint64_t next_random (uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+//returns a size between 16 and (max) bytes, skewed towards small sizes the way real programs are
+static inline size_t random_size (uint64_t* state, size_t max) {
+  uint64_t r     = next_random(state);
+  size_t   limit = (size_t) 16 << (r % 8);
+  if (limit > max) {
+    limit = max;
+  }
+  return 16 + (r >> 8) % (limit - 15);
+}
+
+//writes to the block like a program would, so untouched memory does not flatter an allocator
+static inline void touch (void* ptr, size_t size) {
+  ((volatile char*) ptr)[0]        = 1;
+  ((volatile char*) ptr)[size - 1] = 1;
+}
+
+
+/*
+ * Peak RSS. Writing 5 to /proc/self/clear_refs resets VmHWM to the current RSS, so each test reports its own
+ * peak rather than the largest of every test run before it.
+ */
+static void rss_reset () {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd >= 0) {
+    write(fd, "5", 1);
+    close(fd);
+  }
+}
+
+//returns the peak RSS since the last rss_reset(), in KB
+static long rss_peak () {
+
+  char  line[256];
+  long  peak  = 0;
+  FILE* status = fopen("/proc/self/status", "r");
+  if (status == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (strncmp(line, "VmHWM:", 6) == 0) {
+      peak = strtol(line + 6, NULL, 10);
+    }
+  }
+  fclose(status);
+  return peak;
+}
+
+
+
+/*
+ * Tests. Each one runs (ops) operations spread over (threads) threads and fills one histogram per thread.
+ * An operation is one malloc(), free() or realloc() call.
+ */
+typedef struct job {
+  unsigned  id;
+  unsigned  threads;
+  size_t    ops;
+  hist_s    hist;
+  void*     shared;            //state the threads of a test share
+
+} job_s;
+
+#define WINDOW 4096            //live blocks kept by the tests that keep some
+
+
+//malloc() and free() of 64 bytes, back to back
+static void* test_fixed (void* arg) {
+
+  job_s* job = arg;
+  for (size_t i = 0; i < job -> ops / 2; i += 1) {
+    void* ptr = timed_malloc(&job -> hist, 64);
+    touch(ptr, 64);
+    timed_free(&job -> hist, ptr);
+  }
+  return NULL;
+}
+
+//replaces random blocks of a live window with blocks of random size
+static void* test_random (void* arg) {
+
+  job_s*   job   = arg;
+  uint64_t state = 0x9E3779B97F4A7C15ull + job -> id;
+  void*    live[WINDOW] = { 0 };
+
+  for (size_t i = 0; i < job -> ops / 2; i += 1) {
+    size_t slot = next_random(&state) % WINDOW;
+    if (live[slot] != NULL) {
+      timed_free(&job -> hist, live[slot]);
+    }
+    size_t size = random_size(&state, 4096);
+    live[slot]  = timed_malloc(&job -> hist, size);
+    touch(live[slot], size);
+  }
+  for (size_t slot = 0; slot < WINDOW; slot += 1) {
+    free(live[slot]);
+  }
+  return NULL;
+}
+
+//allocates a window of blocks of random size, then frees them in the order given by (order)
+static void batch_free (job_s* job, int order) {
+
+  uint64_t state = 0x2545F4914F6CDD1Dull + job -> id;
+  void*    live[WINDOW];
+
+  for (size_t round = 0; round < job -> ops / (2 * WINDOW); round += 1) {
+    for (size_t slot = 0; slot < WINDOW; slot += 1) {
+      size_t size = random_size(&state, 1024);
+      live[slot]  = timed_malloc(&job -> hist, size);
+      touch(live[slot], size);
+    }
+
+    if (order == 2) {
+      for (size_t slot = WINDOW - 1; slot > 0; slot -= 1) {
+        size_t other = next_random(&state) % (slot + 1);
+        void*  ptr   = live[slot];
+        live[slot]   = live[other];
+        live[other]  = ptr;
+      }
+    }
+
+    for (size_t slot = 0; slot < WINDOW; slot += 1) {
+      timed_free(&job -> hist, live[order == 0 ? WINDOW - 1 - slot : slot]);
+    }
+  }
+}
+
+static void* test_lifo   (void* arg) { batch_free(arg, 0); return NULL; }
+static void* test_fifo   (void* arg) { batch_free(arg, 1); return NULL; }
+static void* test_shuffle (void* arg) { batch_free(arg, 2); return NULL; }
+
+//grows buffers from nothing to 1 MB in random steps, the way a string builder or vector would
+static void* test_realloc (void* arg) {
+
+  job_s*   job   = arg;
+  uint64_t state = 0x6A09E667F3BCC909ull + job -> id;
+  size_t   done  = 0;
+
+  while (done < job -> ops) {
+    void*  ptr  = NULL;
+    size_t size = 0;
+    while (size < (1 << 20) && done < job -> ops) {
+      size += 16 + next_random(&state) % (size / 4 + 64);
+
+      uint64_t start = now_ns();
+      ptr = realloc(ptr, size);
+      hist_add(&job -> hist, now_ns() - start);
+      touch(ptr, size);
+      done += 1;
+    }
+    timed_free(&job -> hist, ptr);
+    done += 1;
+  }
+  return NULL;
+}
+
+
+/*
+ * Producer/consumer. Threads are paired up; the even one of each pair allocates and passes the blocks through
+ * a single-producer single-consumer ring to the odd one, which frees them. Every free() is a cross-thread free.
+ */
+#define RING_SIZE 1024
+
+typedef struct ring {
+  void*  slots[RING_SIZE];
+  size_t head __attribute__ ((aligned (64)));       //next slot to write, by the producer
+  size_t tail __attribute__ ((aligned (64)));       //next slot to read, by the consumer
+
+} ring_s;
+
+static void* test_prodcons (void* arg) {
+
+  job_s*   job   = arg;
+  ring_s*  ring  = (ring_s*) job -> shared + job -> id / 2;
+  uint64_t state = 0xBB67AE8584CAA73Bull + job -> id;
+  size_t   count = job -> ops / 2;
+
+  if (job -> id % 2 == 0) {
+    for (size_t i = 0; i < count; i += 1) {
+      size_t size = random_size(&state, 1024);
+      void*  ptr  = timed_malloc(&job -> hist, size);
+      touch(ptr, size);
+
+      size_t head = __atomic_load_n(&ring -> head, __ATOMIC_RELAXED);
+      while (head - __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        sched_yield();
+      }
+      ring -> slots[head % RING_SIZE] = ptr;
+      __atomic_store_n(&ring -> head, head + 1, __ATOMIC_RELEASE);
+    }
+  } else {
+    for (size_t i = 0; i < count; i += 1) {
+      size_t tail = __atomic_load_n(&ring -> tail, __ATOMIC_RELAXED);
+      while (__atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE) == tail) {
+        sched_yield();
+      }
+      void* ptr = ring -> slots[tail % RING_SIZE];
+      __atomic_store_n(&ring -> tail, tail + 1, __ATOMIC_RELEASE);
+      timed_free(&job -> hist, ptr);
+    }
+  }
+  return NULL;
+}
+
+
+/*
+ * Larson. Every thread replaces random blocks of its own window, like a server working on its connections, and
+ * after each epoch hands the window on to the next thread, so a share of the frees are of blocks another thread
+ * allocated. The xmalloc test goes further: every thread keeps allocating and all of its blocks are freed by the
+ * thread after it, through the same rings as the producer/consumer test.
+ */
+#define LARSON_EPOCHS 16
+
+typedef struct larson {
+  void*             windows[64][WINDOW / 4];
+  pthread_barrier_t barrier;
+
+} larson_s;
+
+static void* test_larson (void* arg) {
+
+  job_s*    job    = arg;
+  larson_s* larson = job -> shared;
+  uint64_t  state  = 0x3C6EF372FE94F82Bull + job -> id;
+  size_t    per    = job -> ops / 2 / LARSON_EPOCHS;
+
+  for (unsigned epoch = 0; epoch < LARSON_EPOCHS; epoch += 1) {
+    void** window = larson -> windows[(job -> id + epoch) % job -> threads];
+
+    for (size_t i = 0; i < per; i += 1) {
+      size_t slot = next_random(&state) % (WINDOW / 4);
+      if (window[slot] != NULL) {
+        timed_free(&job -> hist, window[slot]);
+      }
+      size_t size  = random_size(&state, 512);
+      window[slot] = timed_malloc(&job -> hist, size);
+      touch(window[slot], size);
+    }
+    pthread_barrier_wait(&larson -> barrier);
+  }
+  return NULL;
+}
+
+static void* test_xmalloc (void* arg) {
+
+  job_s*   job   = arg;
+  ring_s*  out   = (ring_s*) job -> shared + job -> id;
+  ring_s*  in    = (ring_s*) job -> shared + (job -> id + job -> threads - 1) % job -> threads;
+  uint64_t state = 0xA54FF53A5F1D36F1ull + job -> id;
+  size_t   count = job -> ops / 2;
+  size_t   sent  = 0;
+  size_t   freed = 0;
+
+  //with one thread the ring passes blocks back to the thread itself
+  while (freed < count || sent < count) {
+    int    progress = 0;
+    size_t head     = __atomic_load_n(&out -> head, __ATOMIC_RELAXED);
+    if (sent < count && head - __atomic_load_n(&out -> tail, __ATOMIC_ACQUIRE) < RING_SIZE) {
+      size_t size = random_size(&state, 256);
+      void*  ptr  = timed_malloc(&job -> hist, size);
+      touch(ptr, size);
+      out -> slots[head % RING_SIZE] = ptr;
+      __atomic_store_n(&out -> head, head + 1, __ATOMIC_RELEASE);
+      sent    += 1;
+      progress = 1;
+    }
+
+    size_t tail = __atomic_load_n(&in -> tail, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&in -> head, __ATOMIC_ACQUIRE) != tail) {
+      void* ptr = in -> slots[tail % RING_SIZE];
+      __atomic_store_n(&in -> tail, tail + 1, __ATOMIC_RELEASE);
+      timed_free(&job -> hist, ptr);
+      freed   += 1;
+      progress = 1;
+    }
+
+    if (!progress) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+
+typedef struct test {
+  const char* name;
+  void*       (*run) (void*);
+  int         paired;          //needs an even number of threads
+
+} test_s;
+
+static test_s tests[] = {
+  { "fixed",    test_fixed,    0 },
+  { "random",   test_random,   0 },
+  { "lifo",     test_lifo,     0 },
+  { "fifo",     test_fifo,     0 },
+  { "shuffle",  test_shuffle,  0 },
+  { "realloc",  test_realloc,  0 },
+  { "prodcons", test_prodcons, 1 },
+  { "larson",   test_larson,   0 },
+  { "xmalloc",  test_xmalloc,  0 },
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+
+//runs (test) on (threads) threads, (ops) operations in all, and prints its line of the report
+static void run_test (test_s* test, unsigned threads, size_t ops) {
+
+  if (test -> paired && threads % 2 != 0) {
+    threads += 1;
+  }
+
+  job_s*     jobs    = calloc(threads, sizeof(job_s));
+  pthread_t* workers = calloc(threads, sizeof(pthread_t));
+  void*      shared  = NULL;
+  larson_s*  larson  = NULL;
+
+  if (test -> run == test_larson) {
+    larson = calloc(1, sizeof(larson_s));
+    pthread_barrier_init(&larson -> barrier, NULL, threads);
+    shared = larson;
+  } else if (test -> run == test_prodcons || test -> run == test_xmalloc) {
+    shared = calloc(threads, sizeof(ring_s));
+  }
+
+  rss_reset();
+  uint64_t start = now_ns();
+
+  for (unsigned i = 0; i < threads; i += 1) {
+    jobs[i].id      = i;
+    jobs[i].threads = threads;
+    jobs[i].ops     = ops / threads;
+    jobs[i].shared  = shared;
+    pthread_create(&workers[i], NULL, test -> run, &jobs[i]);
+  }
+
+  hist_s total;
+  memset(&total, 0, sizeof(total));
+  for (unsigned i = 0; i < threads; i += 1) {
+    pthread_join(workers[i], NULL);
+    hist_merge(&total, &jobs[i].hist);
+  }
+
+  double seconds = (now_ns() - start) / 1e9;
+  long   peak    = rss_peak();
+
+  printf("%-10s %8u %14.0f %8llu %8llu %8llu %10ld\n", test -> name, threads, total.total / seconds,
+         (unsigned long long) hist_percentile(&total, 0.50), (unsigned long long) hist_percentile(&total, 0.99),
+         (unsigned long long) hist_percentile(&total, 0.999), peak);
+  fflush(stdout);
+
+  if (larson != NULL) {
+    for (unsigned i = 0; i < threads; i += 1) {
+      for (size_t slot = 0; slot < WINDOW / 4; slot += 1) {
+        free(larson -> windows[i][slot]);
+      }
+    }
+    pthread_barrier_destroy(&larson -> barrier);
+  }
+  free(shared);
+  free(workers);
+  free(jobs);
+}
+
+
+int main (int argc, char** argv) {
+
+  unsigned threads = 1;
+  size_t   ops     = 4000000;
+  int      opt;
+
+  while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+    if (opt == 't') {
+      threads = atoi(optarg);
+    } else if (opt == 'n') {
+      ops = strtoull(optarg, NULL, 10);
+    } else {
+      fprintf(stderr, "USAGE: %s [-t threads] [-n operations] [test ...]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (threads < 1 || threads > 64) {
+    fprintf(stderr, "%s: threads must be between 1 and 64\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-10s %8s %14s %8s %8s %8s %10s\n", "test", "threads", "ops/s", "p50 ns", "p99 ns", "p999 ns", "peak KB");
+
+  for (size_t i = 0; i < NUM_TESTS; i += 1) {
+    int selected = optind == argc;
+    for (int arg = optind; arg < argc; arg += 1) {
+      selected |= strcmp(argv[arg], tests[i].name) == 0;
+    }
+    if (selected) {
+      run_test(&tests[i], threads, ops);
+    }
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,79 @@
+/**
+ * pb-hist.h
+ *
+ * Latency histograms shared by pb-bench and pb-replay. Call times are kept in log-linear buckets: one group per
+ * power of two nanoseconds, split into HIST_SUB linear buckets, so percentiles are exact to within 1/HIST_SUB and
+ * a histogram costs no allocation while it is filled.
+ **/
+
+#ifndef PB_HIST_H
+#define PB_HIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HIST_SUB_LOG2 3
+#define HIST_SUB      (1 << HIST_SUB_LOG2)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+typedef struct hist {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+
+} hist_s;
+
+static inline uint64_t now_ns () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//records a call that took (ns) nanoseconds
+static inline void hist_add (hist_s* hist, uint64_t ns) {
+
+  size_t bucket;
+  if (ns < HIST_SUB) {
+    bucket = ns;
+  } else {
+    unsigned msb = 63 - __builtin_clzll(ns);
+    bucket = (msb - HIST_SUB_LOG2 + 1) * HIST_SUB + ((ns >> (msb - HIST_SUB_LOG2)) & (HIST_SUB - 1));
+  }
+
+  hist -> counts[bucket] += 1;
+  hist -> total          += 1;
+}
+
+//returns the lower bound, in nanoseconds, of the bucket (bucket)
+static inline uint64_t hist_bucket_ns (size_t bucket) {
+  if (bucket < HIST_SUB) {
+    return bucket;
+  }
+  unsigned msb = bucket / HIST_SUB + HIST_SUB_LOG2 - 1;
+  return ((uint64_t) HIST_SUB + bucket % HIST_SUB) << (msb - HIST_SUB_LOG2);
+}
+
+//returns the latency below which a (fraction) of the calls fell
+static inline uint64_t hist_percentile (hist_s* hist, double fraction) {
+
+  uint64_t rank = (uint64_t) (fraction * hist -> total);
+  uint64_t seen = 0;
+
+  for (size_t bucket = 0; bucket < HIST_BUCKETS; bucket += 1) {
+    seen += hist -> counts[bucket];
+    if (seen > rank) {
+      return hist_bucket_ns(bucket);
+    }
+  }
+  return 0;
+}
+
+//adds the calls recorded in (from) to (to)
+static inline void hist_merge (hist_s* to, hist_s* from) {
+  for (size_t bucket = 0; bucket < HIST_BUCKETS; bucket += 1) {
+    to -> counts[bucket] += from -> counts[bucket];
+  }
+  to -> total += from -> total;
+}
+
+#endif
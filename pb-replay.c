@@ -0,0 +1,396 @@
+/**
+ * pb-replay.c
+ *
+ * Replays an allocation trace recorded with PB_TRACE against whatever allocator it is linked with, to compare
+ * the latency and fragmentation of placement policies on a real workload. The trace is sorted by time and
+ * replayed on one thread, as fast as it goes, touching every page of the blocks it allocates; blocks are told
+ * apart by the address they had when the trace was taken. It reports the latency of each kind of call, the
+ * peak of the bytes the trace had live and the peak RSS the replay needed for them.
+ *
+ *   gcc -std=gnu99 -O2 -pthread -fno-builtin -DPB_NO_MAIN -o pb-replay pb-replay.c pb-alloc.c
+ *   gcc -std=gnu99 -O2 -pthread -fno-builtin -DPB_NO_MAIN -DPB_TLSF -o pb-replay-tlsf pb-replay.c pb-alloc.c
+ *   gcc -std=gnu99 -O2 -pthread -o pb-replay-libc pb-replay.c
+ *
+ * The best-fit policy is PB_FIT=best pb-replay, as for any program using pb-alloc.
+ *
+ * usage: pb-replay trace
+ **/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pb-alloc.h"
+#include "pb-hist.h"
+
+
+
+/*
+ * Peak RSS. Writing 5 to /proc/self/clear_refs resets VmHWM to the current RSS, which is taken as the baseline,
+ * so the trace itself and the block table are not counted against the allocator.
+ */
+static void rss_reset () {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd >= 0) {
+    write(fd, "5", 1);
+    close(fd);
+  }
+}
+
+//returns the value of the (field) line of /proc/self/status, in KB
+static long status_kb (const char* field) {
+
+  char   line[256];
+  long   value  = 0;
+  size_t length = strlen(field);
+  FILE*  status = fopen("/proc/self/status", "r");
+  if (status == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (strncmp(line, field, length) == 0) {
+      value = strtol(line + length, NULL, 10);
+    }
+  }
+  fclose(status);
+  return value;
+}
+
+
+/*
+ * Block table. Maps the address a block had in the trace to the block the replay allocated for it, with
+ * linear probing and backward-shift deletion. It lives in its own mapping so it stays out of the heap being
+ * measured, and is sized up front from the most blocks the trace has live at once.
+ */
+typedef struct entry {
+  uint64_t key;                //address in the trace, 0 for an empty slot
+  void*    ptr;
+  size_t   size;
+
+} entry_s;
+
+typedef struct table {
+  entry_s* entries;
+  size_t   mask;
+  size_t   count;
+
+} table_s;
+
+static inline size_t table_slot (table_s* table, uint64_t key) {
+  return (key >> 4) * 0x9E3779B97F4A7C15ull >> 20 & table -> mask;
+}
+
+static void table_init (table_s* table, size_t capacity) {
+
+  size_t slots = 1024;
+  while (slots < 2 * capacity) {
+    slots *= 2;
+  }
+
+  table -> entries = mmap(NULL, slots * sizeof(entry_s), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (table -> entries == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memset(table -> entries, 0, slots * sizeof(entry_s));
+  table -> mask  = slots - 1;
+  table -> count = 0;
+}
+
+//returns the entry of (key), or NULL if there is none
+static entry_s* table_find (table_s* table, uint64_t key) {
+  for (size_t slot = table_slot(table, key); table -> entries[slot].key != 0; slot = (slot + 1) & table -> mask) {
+    if (table -> entries[slot].key == key) {
+      return &table -> entries[slot];
+    }
+  }
+  return NULL;
+}
+
+static void table_insert (table_s* table, uint64_t key, void* ptr, size_t size);
+
+//doubles the table, which only happens when the trace frees blocks it never allocated
+static void table_grow (table_s* table) {
+
+  table_s old = *table;
+  table_init(table, old.mask + 1);
+  for (size_t slot = 0; slot <= old.mask; slot += 1) {
+    if (old.entries[slot].key != 0) {
+      table_insert(table, old.entries[slot].key, old.entries[slot].ptr, old.entries[slot].size);
+    }
+  }
+  munmap(old.entries, (old.mask + 1) * sizeof(entry_s));
+}
+
+//maps (key) to (ptr). A key that is there already is remapped, leaking the replay's block for it.
+static void table_insert (table_s* table, uint64_t key, void* ptr, size_t size) {
+
+  if (2 * (table -> count + 1) > table -> mask + 1) {
+    table_grow(table);
+  }
+
+  size_t slot = table_slot(table, key);
+  while (table -> entries[slot].key != 0 && table -> entries[slot].key != key) {
+    slot = (slot + 1) & table -> mask;
+  }
+  if (table -> entries[slot].key == 0) {
+    table -> count += 1;
+  }
+  table -> entries[slot] = (entry_s) { key, ptr, size };
+}
+
+//removes (entry) from the table, shifting later entries of its probe run back into the hole
+static void table_remove (table_s* table, entry_s* entry) {
+
+  size_t hole = entry - table -> entries;
+  size_t slot = hole;
+
+  for (;;) {
+    slot = (slot + 1) & table -> mask;
+    if (table -> entries[slot].key == 0) {
+      break;
+    }
+    size_t home = table_slot(table, table -> entries[slot].key);
+    if (((slot - home) & table -> mask) >= ((slot - hole) & table -> mask)) {
+      table -> entries[hole] = table -> entries[slot];
+      hole = slot;
+    }
+  }
+
+  table -> entries[hole].key = 0;
+  table -> count -= 1;
+}
+
+
+/*
+ * Sorting. Every thread's events are in order already but flushed in chunks, so a stable merge sort by time
+ * puts them back together without reordering calls that share a timestamp.
+ */
+static void sort_events (pb_trace_event_s* events, size_t count) {
+
+  if (count < 2) {
+    return;
+  }
+
+  pb_trace_event_s* scratch = mmap(NULL, count * sizeof(pb_trace_event_s), PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (scratch == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  pb_trace_event_s* from = events;
+  pb_trace_event_s* to   = scratch;
+
+  for (size_t width = 1; width < count; width *= 2) {
+    for (size_t left = 0; left < count; left += 2 * width) {
+      size_t middle = left + width < count ? left + width : count;
+      size_t right  = left + 2 * width < count ? left + 2 * width : count;
+      size_t i = left, j = middle, k = left;
+
+      while (i < middle && j < right) {
+        to[k++] = from[j].time < from[i].time ? from[j++] : from[i++];
+      }
+      while (i < middle) {
+        to[k++] = from[i++];
+      }
+      while (j < right) {
+        to[k++] = from[j++];
+      }
+    }
+    pb_trace_event_s* swap = from;
+    from = to;
+    to   = swap;
+  }
+
+  if (from != events) {
+    memcpy(events, from, count * sizeof(pb_trace_event_s));
+  }
+  munmap(scratch, count * sizeof(pb_trace_event_s));
+}
+
+//returns the most blocks the trace has live at once, as far as its own events tell
+static size_t max_live (pb_trace_event_s* events, size_t count) {
+
+  long live = 0;
+  long most = 0;
+
+  for (size_t i = 0; i < count; i += 1) {
+    pb_trace_event_s* event = &events[i];
+    if (event -> op == PB_TRACE_FREE) {
+      live -= 1;
+    } else if (event -> op == PB_TRACE_REALLOC) {
+      live += (event -> ptr != 0) - (event -> arg != 0 && (event -> ptr != 0 || event -> size == 0));
+    } else if (event -> ptr != 0) {
+      live += 1;
+    }
+    most = live > most ? live : most;
+  }
+  return most;
+}
+
+
+//writes to every page of the block at (ptr) from (from) bytes on, like a program using it would
+static inline void touch (void* ptr, size_t from, size_t size) {
+  for (size_t offset = from; offset < size; offset = (offset | 4095) + 1) {
+    ((volatile char*) ptr)[offset] = 1;
+  }
+}
+
+static const char* op_names[] = { "", "malloc", "free", "calloc", "realloc", "memalign" };
+#define NUM_OPS (sizeof(op_names) / sizeof(op_names[0]))
+
+
+int main (int argc, char** argv) {
+
+  if (argc != 2) {
+    fprintf(stderr, "USAGE: %s trace\n", argv[0]);
+    return 1;
+  }
+
+  int         fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  pb_trace_header_s* header = (size_t) st.st_size >= sizeof(pb_trace_header_s)
+    ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if (header == MAP_FAILED || memcmp(header -> magic, PB_TRACE_MAGIC, sizeof(header -> magic)) != 0 ||
+      header -> event_size != sizeof(pb_trace_event_s)) {
+    fprintf(stderr, "%s: not a pb-alloc trace\n", argv[1]);
+    return 1;
+  }
+  close(fd);
+
+  pb_trace_event_s* events = (pb_trace_event_s*) (header + 1);
+  size_t            count  = (st.st_size - sizeof(pb_trace_header_s)) / sizeof(pb_trace_event_s);
+
+  sort_events(events, count);
+
+  table_s table;
+  table_init(&table, max_live(events, count));
+
+  hist_s   hists[NUM_OPS];
+  size_t   live      = 0;
+  size_t   peak_live = 0;
+  size_t   unmatched = 0;
+  size_t   failed    = 0;
+  memset(hists, 0, sizeof(hists));
+
+  rss_reset();
+  long     baseline = status_kb("VmRSS:");
+  uint64_t start    = now_ns();
+
+  for (size_t i = 0; i < count; i += 1) {
+    pb_trace_event_s* event = &events[i];
+    entry_s*          entry;
+    void*             ptr   = NULL;
+    uint64_t          begin = now_ns();
+
+    switch (event -> op) {
+
+    case PB_TRACE_MALLOC:
+    case PB_TRACE_CALLOC:
+    case PB_TRACE_MEMALIGN:
+      if (event -> ptr == 0) {
+        failed += 1;
+        continue;
+      }
+      if (event -> op == PB_TRACE_MALLOC) {
+        ptr = malloc(event -> size);
+      } else if (event -> op == PB_TRACE_CALLOC) {
+        ptr = calloc(1, event -> size);
+      } else if (posix_memalign(&ptr, event -> arg < sizeof(void*) ? sizeof(void*) : event -> arg, event -> size) != 0) {
+        ptr = NULL;
+      }
+      hist_add(&hists[event -> op], now_ns() - begin);
+      if (ptr == NULL) {
+        failed += 1;
+        continue;
+      }
+      touch(ptr, 0, event -> size);
+      if ((entry = table_find(&table, event -> ptr)) != NULL) {
+        live -= entry -> size;
+        unmatched += 1;
+      }
+      table_insert(&table, event -> ptr, ptr, event -> size);
+      live += event -> size;
+      break;
+
+    case PB_TRACE_FREE:
+      if ((entry = table_find(&table, event -> ptr)) == NULL) {
+        unmatched += 1;
+        continue;
+      }
+      free(entry -> ptr);
+      hist_add(&hists[event -> op], now_ns() - begin);
+      live -= entry -> size;
+      table_remove(&table, entry);
+      break;
+
+    case PB_TRACE_REALLOC: {
+      size_t old_size = 0;
+      if (event -> ptr == 0 && event -> size != 0) {
+        failed += 1;
+        continue;
+      }
+      if (event -> arg != 0) {
+        if ((entry = table_find(&table, event -> arg)) == NULL) {
+          unmatched += 1;
+        } else {
+          ptr      = entry -> ptr;
+          old_size = entry -> size;
+          table_remove(&table, entry);
+        }
+      }
+      begin = now_ns();
+      ptr   = realloc(ptr, event -> size);
+      hist_add(&hists[event -> op], now_ns() - begin);
+      live -= old_size;
+      if (ptr != NULL && event -> size != 0) {
+        touch(ptr, old_size, event -> size);
+        table_insert(&table, event -> ptr, ptr, event -> size);
+        live += event -> size;
+      }
+      break;
+    }
+
+    default:
+      continue;
+    }
+
+    peak_live = live > peak_live ? live : peak_live;
+  }
+
+  double seconds = (now_ns() - start) / 1e9;
+  long   peak    = status_kb("VmHWM:") - baseline;
+
+  printf("%-10s %12s %8s %8s %8s\n", "call", "count", "p50 ns", "p99 ns", "p999 ns");
+  for (size_t op = 1; op < NUM_OPS; op += 1) {
+    if (hists[op].total > 0) {
+      printf("%-10s %12llu %8llu %8llu %8llu\n", op_names[op], (unsigned long long) hists[op].total,
+             (unsigned long long) hist_percentile(&hists[op], 0.50), (unsigned long long) hist_percentile(&hists[op], 0.99),
+             (unsigned long long) hist_percentile(&hists[op], 0.999));
+    }
+  }
+
+  printf("\nevents          %12zu in %.3f s\n", count, seconds);
+  printf("unmatched       %12zu\n", unmatched);
+  printf("failed          %12zu\n", failed);
+  printf("peak live KB    %12zu\n", peak_live / 1024);
+  printf("peak RSS KB     %12ld\n", peak);
+  printf("RSS / live      %12.3f\n", peak_live > 0 ? peak * 1024.0 / peak_live : 0.0);
+
+  return 0;
+
+}
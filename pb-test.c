@@ -0,0 +1,1108 @@
+/**
+ * pb-test.c
+ *
+ * Behavior checks for pb-alloc. Each check stops the program with an assertion when it fails, so the exit status
+ * says whether they all passed. Checks that need the allocator set up differently run pb-test again in a child
+ * process.
+ *
+ * make check builds it against the normal, TLSF and hardened builds and runs it with both placement policies,
+ * and with several arenas and eager purging.
+ *
+ * usage: pb-test
+ **/
+
+#define _GNU_SOURCE
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "pb-alloc.h"
+
+
+
+#define THREADS 4
+#define WINDOW  1024           //live blocks kept by each stress thread
+#define HANDOFF 4096           //blocks one thread passes to another to free
+
+//xorshift64*, so every thread has a cheap generator of its own
+static inline uint64_t next_random (uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1Dull;
+}
+
+//returns a size that is mostly small, sometimes a few KB and now and then big enough for a mapping of its own
+static size_t random_size (uint64_t* state) {
+  uint64_t r = next_random(state);
+  switch (r % 64) {
+  case 0:  return 1 + (r >> 8) % (2 << 20);
+  case 1:
+  case 2:
+  case 3:  return 1 + (r >> 8) % 65536;
+  default: return 1 + (r >> 8) % 512;
+  }
+}
+
+//fills the (size) bytes at (ptr) with a pattern that depends on (seed)
+static void fill (void* ptr, size_t size, uint8_t seed) {
+  memset(ptr, seed, size);
+}
+
+//checks that the (size) bytes at (ptr) still hold the pattern of (seed)
+static void check_fill (const void* ptr, size_t size, uint8_t seed) {
+  const uint8_t* bytes = ptr;
+  for (size_t i = 0; i < size; i += 1) {
+    assert(bytes[i] == seed);
+  }
+}
+
+//runs pb-test again with (mode) as its argument and the environment variable (name) set to (value). Returns its
+//wait status.
+static int run_self (const char* mode, const char* name, const char* value) {
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    setenv(name, value, 1);
+    execl("/proc/self/exe", "pb-test", mode, (char*) NULL);
+    _exit(127);
+  }
+
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  return status;
+}
+
+//returns the bytes of blocks in use, in the heap or mapped on their own, after giving every free one back
+static size_t heap_in_use () {
+  malloc_trim(0);
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+
+/*
+ * Stress. Every thread keeps a window of live blocks and replaces random ones with malloc(), calloc(),
+ * realloc() or aligned_alloc() blocks of random size, checking that a block still holds what was written to it
+ * before it goes. Blocks of the window are also given to the next thread's inbox, so frees cross arenas.
+ */
+typedef struct block {
+  void*   ptr;
+  size_t  size;
+  uint8_t seed;
+
+} block_s;
+
+typedef struct inbox {
+  pthread_mutex_t lock;
+  block_s         blocks[HANDOFF];
+  size_t          count;
+
+} inbox_s;
+
+static inbox_s inboxes[THREADS];
+
+//frees every block waiting in (inbox)
+static void inbox_drain (inbox_s* inbox) {
+  pthread_mutex_lock(&inbox -> lock);
+  for (size_t i = 0; i < inbox -> count; i += 1) {
+    check_fill(inbox -> blocks[i].ptr, inbox -> blocks[i].size, inbox -> blocks[i].seed);
+    free(inbox -> blocks[i].ptr);
+  }
+  inbox -> count = 0;
+  pthread_mutex_unlock(&inbox -> lock);
+}
+
+//passes (block) to (inbox) to be freed by its thread. Returns 0 when the inbox is full.
+static int inbox_give (inbox_s* inbox, block_s block) {
+  int given = 0;
+  pthread_mutex_lock(&inbox -> lock);
+  if (inbox -> count < HANDOFF) {
+    inbox -> blocks[inbox -> count++] = block;
+    given = 1;
+  }
+  pthread_mutex_unlock(&inbox -> lock);
+  return given;
+}
+
+//runs the stress operations of thread (arg)
+static void* stress_thread (void* arg) {
+
+  unsigned id    = (unsigned) (uintptr_t) arg;
+  uint64_t state = 0x9E3779B97F4A7C15ull * (id + 1);
+  block_s* live  = calloc(WINDOW, sizeof(block_s));
+  assert(live != NULL);
+
+  for (size_t op = 0; op < 100000; op += 1) {
+    block_s* block = &live[next_random(&state) % WINDOW];
+    uint64_t kind  = next_random(&state) % 8;
+
+    if (block -> ptr != NULL) {
+      check_fill(block -> ptr, block -> size, block -> seed);
+
+      if (kind == 0) {
+        size_t size = random_size(&state);
+        void*  ptr  = realloc(block -> ptr, size);
+        assert(ptr != NULL);
+        check_fill(ptr, size < block -> size ? size : block -> size, block -> seed);
+        block -> ptr  = ptr;
+        block -> size = size;
+        fill(block -> ptr, block -> size, block -> seed);
+        continue;
+      }
+      if (kind == 1 && inbox_give(&inboxes[(id + 1) % THREADS], *block)) {
+        block -> ptr = NULL;
+        continue;
+      }
+      free(block -> ptr);
+      block -> ptr = NULL;
+    }
+
+    block -> size = random_size(&state);
+    block -> seed = (uint8_t) next_random(&state);
+    if (kind == 2) {
+      block -> ptr = calloc(1, block -> size);
+      assert(block -> ptr != NULL);
+      check_fill(block -> ptr, block -> size, 0);
+    } else if (kind == 3) {
+      size_t alignment = (size_t) 16 << next_random(&state) % 10;
+      block -> size    = (block -> size + alignment - 1) & ~(alignment - 1);
+      block -> ptr     = aligned_alloc(alignment, block -> size);
+      assert(block -> ptr != NULL && (uintptr_t) block -> ptr % alignment == 0);
+    } else {
+      block -> ptr = malloc(block -> size);
+      assert(block -> ptr != NULL);
+    }
+    fill(block -> ptr, block -> size, block -> seed);
+
+    if (op % 1024 == 0) {
+      inbox_drain(&inboxes[id]);
+    }
+  }
+
+  for (size_t slot = 0; slot < WINDOW; slot += 1) {
+    if (live[slot].ptr != NULL) {
+      check_fill(live[slot].ptr, live[slot].size, live[slot].seed);
+      free(live[slot].ptr);
+    }
+  }
+  free(live);
+  return NULL;
+}
+
+static void test_stress () {
+
+  pthread_t threads[THREADS];
+
+  for (unsigned i = 0; i < THREADS; i += 1) {
+    pthread_mutex_init(&inboxes[i].lock, NULL);
+  }
+  for (unsigned i = 0; i < THREADS; i += 1) {
+    assert(pthread_create(&threads[i], NULL, stress_thread, (void*) (uintptr_t) i) == 0);
+  }
+  for (unsigned i = 0; i < THREADS; i += 1) {
+    pthread_join(threads[i], NULL);
+  }
+  for (unsigned i = 0; i < THREADS; i += 1) {
+    inbox_drain(&inboxes[i]);
+  }
+}
+
+
+/*
+ * Cross-thread frees. One thread allocates blocks of every kind and exits, another checks and frees them, so
+ * every free goes to an arena the freeing thread does not own once there is more than one. The freed memory
+ * must come back: the same blocks are asked for again a few times without the heap growing for each round.
+ */
+typedef struct handoff {
+  void*  ptrs[HANDOFF];
+  size_t sizes[HANDOFF];
+
+} handoff_s;
+
+//allocates and fills the blocks of (arg)
+static void* handoff_alloc (void* arg) {
+  handoff_s* handoff = arg;
+  for (size_t i = 0; i < HANDOFF; i += 1) {
+    handoff -> sizes[i] = i % 16 == 0 ? 4096 + i * 8 : 1 + i % 700;
+    handoff -> ptrs[i]  = malloc(handoff -> sizes[i]);
+    assert(handoff -> ptrs[i] != NULL);
+    fill(handoff -> ptrs[i], handoff -> sizes[i], (uint8_t) i);
+  }
+  return NULL;
+}
+
+//checks and frees the blocks of (arg)
+static void* handoff_free (void* arg) {
+  handoff_s* handoff = arg;
+  for (size_t i = 0; i < HANDOFF; i += 1) {
+    check_fill(handoff -> ptrs[i], handoff -> sizes[i], (uint8_t) i);
+    free(handoff -> ptrs[i]);
+  }
+  return NULL;
+}
+
+static void test_cross_thread_free () {
+
+  static handoff_s handoff;
+  struct mallinfo2 first = { 0 };
+
+  for (int round = 0; round < 8; round += 1) {
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, handoff_alloc, &handoff) == 0);
+    pthread_join(thread, NULL);
+    assert(pthread_create(&thread, NULL, handoff_free, &handoff) == 0);
+    pthread_join(thread, NULL);
+
+    malloc_trim(0);                        //drains the remote frees of every arena
+    struct mallinfo2 info = mallinfo2();
+    if (round == 0) {
+      first = info;
+    }
+    assert(info.uordblks <= first.uordblks + first.uordblks / 2 + 65536);
+  }
+}
+
+
+/*
+ * calloc() after malloc_trim(). Trimming lowers the high_water mark of a segment, and calloc() skips clearing
+ * memory above it, so blocks that were dirtied, freed and trimmed have to read as zero, whether calloc() takes
+ * them from the bump region or from a free list.
+ */
+static void test_calloc_after_trim () {
+
+  static const size_t sizes[] = { 24, 200, 3000, 40000, 200000, 3 << 20 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i += 1) {
+    void* ptrs[16];
+    for (int j = 0; j < 16; j += 1) {
+      ptrs[j] = malloc(sizes[i]);
+      assert(ptrs[j] != NULL);
+      fill(ptrs[j], sizes[i], 0xA5);
+    }
+    for (int j = 15; j >= 0; j -= 1) {
+      free(ptrs[j]);
+    }
+    malloc_trim(0);                        //also gives the thread's cached blocks back
+
+    for (int j = 0; j < 16; j += 1) {
+      ptrs[j] = calloc(1, sizes[i]);
+      assert(ptrs[j] != NULL);
+      check_fill(ptrs[j], sizes[i], 0);
+      fill(ptrs[j], sizes[i], 0xA5);
+    }
+    for (int j = 0; j < 16; j += 1) {
+      free(ptrs[j]);
+    }
+  }
+
+  volatile size_t count = SIZE_MAX / 2;      //keeps the compiler from flagging the overflow
+  errno = 0;
+  assert(calloc(count, 3) == NULL && errno == ENOMEM);
+}
+
+
+/*
+ * Heap profiler. pb-test runs itself with PB_PROF_SAMPLE set to PROF_INTERVAL. A block much bigger than the
+ * interval is always sampled, so the heap_v2 header of a dump has to count each such block while it is live,
+ * with one record apiece, and stop counting it once it is freed.
+ */
+#define PROF_INTERVAL "4096"
+#define PROF_BLOCKS   64
+
+//dumps the heap profile and reads the counts of its header into (live) and (bytes)
+static void prof_read (size_t* live, size_t* bytes) {
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/pb-test-%d.prof", (int) getpid());
+  assert(pb_prof_dump(path) == 0);
+
+  FILE*  file = fopen(path, "r");
+  size_t live_again;
+  size_t bytes_again;
+  size_t interval;
+  assert(file != NULL);
+  assert(fscanf(file, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live, bytes, &live_again, &bytes_again,
+                &interval) == 5);
+  assert(*live == live_again && *bytes == bytes_again && interval == strtoull(PROF_INTERVAL, NULL, 10));
+
+  char   line[4096];
+  size_t records = 0;
+  size_t size;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "1: %zu [1: %zu] @", &size, &size) == 2) {
+      records += 1;
+    }
+  }
+  assert(records == *live);
+
+  fclose(file);
+  unlink(path);
+}
+
+static void test_batch_mixed ();
+
+//the profile child: checks the dumps taken around PROF_BLOCKS big blocks
+static int child_profile () {
+
+  static void* ptrs[PROF_BLOCKS];
+  size_t       live;
+  size_t       bytes;
+  size_t       base_live;
+  size_t       base_bytes;
+
+  free(malloc(1));                         //sets the heap up, which reads PB_PROF_SAMPLE
+  prof_read(&base_live, &base_bytes);
+
+  for (int i = 0; i < PROF_BLOCKS; i += 1) {
+    ptrs[i] = malloc(i % 8 == 0 ? 2 << 20 : 256 << 10);
+    assert(ptrs[i] != NULL);
+  }
+  prof_read(&live, &bytes);
+  assert(live == base_live + PROF_BLOCKS);
+  assert(bytes >= base_bytes + PROF_BLOCKS / 8 * (2 << 20) + (PROF_BLOCKS - PROF_BLOCKS / 8) * (256 << 10));
+
+  for (int i = 0; i < PROF_BLOCKS; i += 1) {
+    free(ptrs[i]);
+  }
+  prof_read(&live, &bytes);
+  assert(live == base_live && bytes == base_bytes);
+
+  test_batch_mixed();                      //the first thread leaves what glibc keeps for threads allocated
+  prof_read(&base_live, &base_bytes);
+  test_batch_mixed();                      //with some of its blocks sampled
+  prof_read(&live, &bytes);
+  assert(live == base_live && bytes == base_bytes);
+  return 0;
+}
+
+static void test_profile () {
+  int status = run_self("profile", "PB_PROF_SAMPLE", PROF_INTERVAL);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+
+/*
+ * Allocation traces. pb-test runs itself with PB_TRACE set and makes a known set of calls, which have to show up
+ * in the trace. The trace is then replayed with the pb-replay next to pb-test, if there is one: every block it
+ * frees has to match one it allocated, and none of the calls may fail.
+ */
+#define TRACE_ROUNDS 64
+
+//the trace child: makes TRACE_ROUNDS calls of each kind
+static void child_trace () {
+  void* first = malloc(1);                 //sets the heap up, which opens the PB_TRACE file. It may not be traced,
+  assert(first != NULL);                   //so it is never freed either
+  for (size_t i = 0; i < TRACE_ROUNDS; i += 1) {
+    void* ptr     = malloc(1 + i * 40);
+    void* zeroed  = calloc(i + 1, 24);
+    void* aligned = aligned_alloc(64, 64 * (i + 1));
+    assert(ptr != NULL && zeroed != NULL && aligned != NULL);
+    ptr = realloc(ptr, 1 + i * 80);
+    assert(ptr != NULL);
+    free(ptr);
+    free(zeroed);
+    free(aligned);
+  }
+}
+
+//runs the pb-replay next to pb-test on the trace at (path), which holds (count) events
+static void trace_replay (const char* path, size_t count) {
+
+  char replay[4096];
+  char command[8192];
+  ssize_t length = readlink("/proc/self/exe", replay, sizeof(replay) - sizeof("pb-replay"));
+  assert(length > 0);
+  replay[length] = '\0';
+  strcpy(strrchr(replay, '/') + 1, "pb-replay");
+  if (access(replay, X_OK) != 0) {
+    fprintf(stderr, "pb-test: no pb-replay next to pb-test, the trace is not replayed\n");
+    return;
+  }
+
+  snprintf(command, sizeof(command), "%s %s", replay, path);
+  FILE* output = popen(command, "r");
+  assert(output != NULL);
+
+  char   line[256];
+  size_t events    = 0;
+  size_t unmatched = 1;
+  size_t failed    = 1;
+  while (fgets(line, sizeof(line), output) != NULL) {
+    sscanf(line, "events %zu", &events);
+    sscanf(line, "unmatched %zu", &unmatched);
+    sscanf(line, "failed %zu", &failed);
+  }
+  assert(pclose(output) == 0);
+  assert(events == count && unmatched == 0 && failed == 0);
+}
+
+static void test_trace () {
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/pb-test-%d.trace", (int) getpid());
+  int status = run_self("trace", "PB_TRACE", path);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  FILE*             file = fopen(path, "r");
+  pb_trace_header_s header;
+  pb_trace_event_s  event;
+  size_t            counts[PB_TRACE_MEMALIGN + 1] = { 0 };
+  size_t            count = 0;
+  assert(file != NULL);
+  assert(fread(&header, sizeof(header), 1, file) == 1);
+  assert(memcmp(header.magic, PB_TRACE_MAGIC, sizeof(header.magic)) == 0 && header.event_size == sizeof(event));
+
+  while (fread(&event, sizeof(event), 1, file) == 1) {
+    assert(event.op >= PB_TRACE_MALLOC && event.op <= PB_TRACE_MEMALIGN && event.thread != 0);
+    assert(event.ptr != 0 || event.op == PB_TRACE_FREE);
+    counts[event.op] += 1;
+    count += 1;
+  }
+  fclose(file);
+
+  assert(counts[PB_TRACE_MALLOC] >= TRACE_ROUNDS && counts[PB_TRACE_CALLOC] >= TRACE_ROUNDS);
+  assert(counts[PB_TRACE_REALLOC] >= TRACE_ROUNDS && counts[PB_TRACE_MEMALIGN] >= TRACE_ROUNDS);
+  assert(counts[PB_TRACE_FREE] >= 3 * TRACE_ROUNDS);
+
+  trace_replay(path, count);
+  unlink(path);
+}
+
+
+/*
+ * fork(). Other threads keep allocating while the main thread forks, and the child has to be able to use the
+ * heap, including the arena and the locks a thread of the parent held at the time. A child that deadlocks is
+ * killed by its alarm.
+ */
+static volatile int forking = 1;
+
+//allocates and frees blocks until forking is cleared
+static void* fork_churn (void* arg) {
+  uint64_t state = (uintptr_t) arg;
+  while (forking) {
+    void* ptr = malloc(random_size(&state) % 8192 + 1);
+    assert(ptr != NULL);
+    free(ptr);
+  }
+  return NULL;
+}
+
+static void test_fork () {
+
+  pthread_t threads[2];
+  forking = 1;
+  for (unsigned i = 0; i < 2; i += 1) {
+    assert(pthread_create(&threads[i], NULL, fork_churn, (void*) (uintptr_t) (i + 7)) == 0);
+  }
+
+  for (int round = 0; round < 20; round += 1) {
+    void* before = malloc(100);
+    fill(before, 100, 0x5A);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      alarm(10);
+      check_fill(before, 100, 0x5A);
+      free(before);
+      uint64_t state = 42;
+      for (int i = 0; i < 10000; i += 1) {
+        void* ptr = malloc(random_size(&state));
+        if (ptr == NULL) {
+          _exit(2);
+        }
+        free(ptr);
+      }
+      malloc_trim(0);
+      _exit(0);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    free(before);
+  }
+
+  forking = 0;
+  for (unsigned i = 0; i < 2; i += 1) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+
+/*
+ * Sized frees. free_sized() and free_aligned_sized() are given the size, and the alignment, a block was asked
+ * for, as is the sized operator delete of C++, which pb-alloc-cxx.cc forwards to free_sized(). A small block
+ * goes back to the thread cache, so the next malloc() of its size returns it again.
+ */
+void* _Znwm (size_t size);                       //operator new (std::size_t)
+void* _Znam (size_t size);                       //operator new[] (std::size_t)
+void  _ZdlPvm (void* ptr, size_t size);          //operator delete (void*, std::size_t)
+void  _ZdaPvm (void* ptr, size_t size);          //operator delete[] (void*, std::size_t)
+
+static void test_free_sized () {
+
+  static const size_t sizes[]      = { 1, 24, 100, 128, 129, 700, 1024, 5000, 200000, 3 << 20 };
+  static const size_t alignments[] = { 16, 64, 4096 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i += 1) {
+    void* ptr = malloc(sizes[i]);
+    assert(ptr != NULL);
+    fill(ptr, sizes[i], 0x11);
+    free_sized(ptr, sizes[i]);
+
+    void* again = malloc(sizes[i]);
+    assert(again != NULL && (sizes[i] > 128 || again == ptr));
+    free_sized(again, sizes[i]);
+
+    ptr = calloc(4, sizes[i]);
+    assert(ptr != NULL);
+    free_sized(ptr, 4 * sizes[i]);
+
+    ptr = realloc(malloc(16), sizes[i]);
+    assert(ptr != NULL);
+    fill(ptr, sizes[i], 0x22);
+    free_sized(ptr, sizes[i]);
+
+    for (size_t j = 0; j < sizeof(alignments) / sizeof(alignments[0]); j += 1) {
+      size_t size = (sizes[i] + alignments[j] - 1) & ~(alignments[j] - 1);
+      ptr = aligned_alloc(alignments[j], size);
+      assert(ptr != NULL && (uintptr_t) ptr % alignments[j] == 0);
+      fill(ptr, size, 0x33);
+      free_aligned_sized(ptr, alignments[j], size);
+    }
+
+    ptr = _Znwm(sizes[i]);
+    fill(ptr, sizes[i], 0x44);
+    _ZdlPvm(ptr, sizes[i]);
+    again = malloc(sizes[i]);
+    assert(again != NULL && (sizes[i] > 128 || again == ptr));
+    free(again);
+
+    ptr = _Znam(sizes[i]);
+    fill(ptr, sizes[i], 0x55);
+    _ZdaPvm(ptr, sizes[i]);
+  }
+
+  free_sized(NULL, 100);
+  free_aligned_sized(NULL, 64, 100);
+}
+
+
+/*
+ * Batches. pb_malloc_batch() fills its array from the thread cache and then from the arena, well past what the
+ * cache holds, and says how many blocks it got when the heap runs out. pb_free_batch() takes blocks of every
+ * kind: slab objects and blocks of the caller's arena, blocks of another thread, large mappings, sampled blocks
+ * (when the profile child runs it) and NULL.
+ */
+#define BATCH 1000
+
+static void test_batch_fill () {
+
+  static void*        ptrs[BATCH];
+  static const size_t sizes[] = { 48, 700 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i += 1) {
+    for (int round = 0; round < 2; round += 1) {
+      assert(pb_malloc_batch(sizes[i], BATCH, ptrs) == BATCH);
+      for (size_t j = 0; j < BATCH; j += 1) {
+        assert(ptrs[j] != NULL);
+        fill(ptrs[j], sizes[i], (uint8_t) j);
+      }
+      for (size_t j = 0; j < BATCH; j += 1) {
+        check_fill(ptrs[j], sizes[i], (uint8_t) j);
+      }
+      pb_free_batch(ptrs, BATCH);
+    }
+  }
+}
+
+//a child with its address space capped just above what it uses asks for more than fits
+static void test_batch_partial () {
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    static void*  ptrs[1 << 18];
+    unsigned long pages = 0;
+    FILE*         statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL || fscanf(statm, "%lu", &pages) != 1) {
+      _exit(2);
+    }
+    fclose(statm);
+
+    struct rlimit limit;
+    limit.rlim_cur = limit.rlim_max = pages * sysconf(_SC_PAGESIZE) + (32 << 20);
+    if (setrlimit(RLIMIT_AS, &limit) != 0) {
+      _exit(2);
+    }
+
+    errno = 0;
+    size_t taken = pb_malloc_batch(512, 1 << 18, ptrs);
+    if (taken >= 1 << 18 || errno != ENOMEM) {
+      _exit(1);
+    }
+    pb_free_batch(ptrs, taken);
+    _exit(0);
+  }
+
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+//allocates the blocks of another thread into (arg)
+static void* batch_foreign (void* arg) {
+  void** ptrs = arg;
+  for (int i = 0; i < 16; i += 1) {
+    ptrs[i] = malloc(i % 2 == 0 ? 40 : 600);
+    assert(ptrs[i] != NULL);
+  }
+  return NULL;
+}
+
+static void test_batch_mixed () {
+
+  void*     ptrs[64];
+  size_t    count  = 16;
+  size_t    before = heap_in_use();
+  pthread_t thread;
+
+  assert(pthread_create(&thread, NULL, batch_foreign, ptrs) == 0);
+  pthread_join(thread, NULL);
+
+  for (int i = 0; i < 16; i += 1) {
+    ptrs[count++] = malloc(40);
+    ptrs[count++] = malloc(600);
+  }
+  for (int i = 0; i < 4; i += 1) {
+    ptrs[count++] = malloc(256 << 10);
+    ptrs[count++] = malloc(2 << 20);
+  }
+  for (size_t i = 0; i < count; i += 1) {
+    assert(ptrs[i] != NULL);
+  }
+  ptrs[count++] = NULL;
+
+  pb_free_batch(ptrs, count);
+  assert(heap_in_use() <= before + 4096);
+}
+
+
+/*
+ * Regions. Region memory is aligned like malloc()'s, an object bigger than a quarter of a chunk gets a chunk of
+ * its own without ending the one the region bumps from, a reset keeps the chunk the region bumps from, and
+ * destroying a region gives everything back.
+ */
+static void test_region () {
+
+  static char* ptrs[1000];
+  pb_region_s* region = pb_region_create(0);
+  assert(region != NULL);
+
+  for (size_t i = 0; i < 1000; i += 1) {
+    ptrs[i] = pb_region_alloc(region, 1 + i % 100);
+    assert(ptrs[i] != NULL && (uintptr_t) ptrs[i] % 16 == 0);
+    fill(ptrs[i], 1 + i % 100, (uint8_t) i);
+  }
+  for (size_t i = 0; i < 1000; i += 1) {
+    check_fill(ptrs[i], 1 + i % 100, (uint8_t) i);
+  }
+  pb_region_destroy(region);
+
+  region = pb_region_create(4096);
+  assert(region != NULL);
+  char* small = pb_region_alloc(region, 100);
+  char* big   = pb_region_alloc(region, 5000);
+  char* next  = pb_region_alloc(region, 100);
+  assert(small != NULL && big != NULL && next == small + 112);
+  assert(big + 5000 <= small || big >= small + 4096);
+  fill(big, 5000, 0x66);
+
+  char* first = next;                      //first object of the chunk bumped from
+  char* last  = next;
+  for (int i = 0; i < 200; i += 1) {
+    char* ptr = pb_region_alloc(region, 1000);
+    assert(ptr != NULL);
+    if (ptr != last + (last == next ? 112 : 1008)) {
+      first = ptr;
+    }
+    last = ptr;
+  }
+  pb_region_reset(region);
+  assert(pb_region_alloc(region, 1000) == first);
+  pb_region_destroy(region);
+
+  size_t before = heap_in_use();
+  region = pb_region_create(0);
+  assert(region != NULL);
+  for (size_t i = 0; i < 4096; i += 1) {
+    size_t size = i % 64 == 0 ? 100000 : 1 + i * 7 % 3000;
+    char*  ptr  = pb_region_alloc(region, size);
+    assert(ptr != NULL);
+    fill(ptr, size, 0x77);
+  }
+  pb_region_destroy(region);
+  assert(heap_in_use() <= before + 4096);
+}
+
+
+/*
+ * Pools. A thread's magazine goes back to its pool when the thread exits, objects freed by another thread are
+ * given out again, and a magazine still holding objects of a destroyed pool never hands them out once the
+ * pool's header is reused: only the serial tells the two pools apart.
+ */
+#define POOL_OBJECTS 32
+#define POOL_SLOTS   8            //magazines of a thread, picked by the pool's serial modulo this
+
+typedef struct pool_thread {
+  pb_pool_s*        pool;
+  void*             ptrs[200];
+  size_t            count;
+  pthread_barrier_t barrier;
+
+} pool_thread_s;
+
+//returns 1 if (ptr) is one of the (count) pointers at (ptrs)
+static int pool_holds (void* const* ptrs, size_t count, const void* ptr) {
+  for (size_t i = 0; i < count; i += 1) {
+    if (ptrs[i] == ptr) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//takes POOL_OBJECTS objects and gives them back, so they sit in the thread's magazine when it exits
+static void* pool_exit_thread (void* arg) {
+  pool_thread_s* thread = arg;
+  for (size_t i = 0; i < POOL_OBJECTS; i += 1) {
+    thread -> ptrs[i] = pb_pool_alloc(thread -> pool);
+    assert(thread -> ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < POOL_OBJECTS; i += 1) {
+    pb_pool_free(thread -> pool, thread -> ptrs[i]);
+  }
+  thread -> count = POOL_OBJECTS;
+  return NULL;
+}
+
+//takes (count) objects and writes their index to them
+static void* pool_alloc_thread (void* arg) {
+  pool_thread_s* thread = arg;
+  for (size_t i = 0; i < thread -> count; i += 1) {
+    thread -> ptrs[i] = pb_pool_alloc(thread -> pool);
+    assert(thread -> ptrs[i] != NULL);
+    fill(thread -> ptrs[i], 64, (uint8_t) i);
+  }
+  return NULL;
+}
+
+//checks and frees the objects the last thread took
+static void* pool_free_thread (void* arg) {
+  pool_thread_s* thread = arg;
+  for (size_t i = 0; i < thread -> count; i += 1) {
+    check_fill(thread -> ptrs[i], 64, (uint8_t) i);
+    pb_pool_free(thread -> pool, thread -> ptrs[i]);
+  }
+  return NULL;
+}
+
+//fills its magazine from a pool that main then destroys, and allocates from the pool that reuses its header
+static void* pool_stale_thread (void* arg) {
+
+  pool_thread_s* thread = arg;
+  for (size_t i = 0; i < 16; i += 1) {
+    thread -> ptrs[i] = pb_pool_alloc(thread -> pool);
+    assert(thread -> ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < 16; i += 1) {
+    pb_pool_free(thread -> pool, thread -> ptrs[i]);
+  }
+  thread -> count = 16;
+
+  pthread_barrier_wait(&thread -> barrier);          //main destroys the pool and creates the next one
+  pthread_barrier_wait(&thread -> barrier);
+
+  for (size_t i = 16; i < 56; i += 1) {
+    thread -> ptrs[i] = pb_pool_alloc(thread -> pool);
+    assert(thread -> ptrs[i] != NULL && !pool_holds(thread -> ptrs, 16, thread -> ptrs[i]));
+    memset(thread -> ptrs[i], 0xFF, 64);
+  }
+  for (size_t i = 16; i < 56; i += 1) {
+    pb_pool_free(thread -> pool, thread -> ptrs[i]);
+  }
+  return NULL;
+}
+
+static void test_pool () {
+
+  static pool_thread_s thread;
+  static void*         ptrs[200];
+  pthread_t            id;
+
+  //a thread's magazine goes back to the pool when the thread exits
+  thread.pool = pb_pool_create(64, 64);
+  assert(thread.pool != NULL);
+  assert(pthread_create(&id, NULL, pool_exit_thread, &thread) == 0);
+  pthread_join(id, NULL);
+  for (size_t i = 0; i < POOL_OBJECTS; i += 1) {
+    ptrs[i] = pb_pool_alloc(thread.pool);
+    assert(ptrs[i] != NULL && (uintptr_t) ptrs[i] % 64 == 0);
+    assert(pool_holds(thread.ptrs, POOL_OBJECTS, ptrs[i]));
+  }
+  pb_pool_destroy(thread.pool);
+
+  //objects one thread takes and another frees are given out again
+  thread.pool  = pb_pool_create(64, 0);
+  thread.count = 100;
+  assert(thread.pool != NULL);
+  assert(pthread_create(&id, NULL, pool_alloc_thread, &thread) == 0);
+  pthread_join(id, NULL);
+  assert(pthread_create(&id, NULL, pool_free_thread, &thread) == 0);
+  pthread_join(id, NULL);
+  for (size_t i = 0; i < 200; i += 1) {
+    ptrs[i] = pb_pool_alloc(thread.pool);
+    assert(ptrs[i] != NULL && !pool_holds(ptrs, i, ptrs[i]));
+  }
+  for (size_t i = 0; i < 100; i += 1) {
+    assert(pool_holds(ptrs, 200, thread.ptrs[i]));
+  }
+  pb_pool_destroy(thread.pool);
+
+  //a stale magazine of a destroyed pool whose header is reused
+  pb_pool_s* stale = pb_pool_create(64, 64);
+  assert(stale != NULL);
+  pb_pool_free(stale, pb_pool_alloc(stale));   //main takes the first chunk, so it goes back to main's arena
+  thread.pool = stale;
+  pthread_barrier_init(&thread.barrier, NULL, 2);
+  assert(pthread_create(&id, NULL, pool_stale_thread, &thread) == 0);
+  pthread_barrier_wait(&thread.barrier);
+  pb_pool_destroy(stale);
+
+  //take the freed chunk back with malloc() blocks, so that nothing else can legitimately use its objects
+  static void* held[64];
+  size_t       holding = 0;
+  int          covered = 0;
+  while (!covered) {
+    assert(holding < 64);
+    held[holding] = aligned_alloc(64, 64 << 10);
+    assert(held[holding] != NULL);
+    fill(held[holding], 64 << 10, 0x3C);
+    holding += 1;
+    covered  = 1;
+    for (size_t i = 0; i < thread.count; i += 1) {
+      char* ptr    = thread.ptrs[i];
+      int   inside = 0;
+      for (size_t j = 0; j < holding; j += 1) {
+        inside |= ptr >= (char*) held[j] && ptr + 64 <= (char*) held[j] + (64 << 10);
+      }
+      covered &= inside;
+    }
+  }
+
+  //create pools until the stale header comes back with a serial that picks the stale magazine's slot again,
+  //destroying it whenever it comes back too early
+  pb_pool_s* live[64];
+  size_t     created = 0;
+  for (size_t serials = 1; ; serials += 1) {
+    pb_pool_s* pool = pb_pool_create(64, 64);
+    assert(pool != NULL);
+    if (pool != stale) {
+      assert(created < 64);
+      live[created++] = pool;
+    } else if (serials % POOL_SLOTS == 0) {
+      break;
+    } else {
+      pb_pool_destroy(pool);
+    }
+  }
+
+  pthread_barrier_wait(&thread.barrier);
+  pthread_join(id, NULL);
+
+  for (size_t i = 0; i < 200; i += 1) {
+    ptrs[i] = pb_pool_alloc(stale);
+    assert(ptrs[i] != NULL && !pool_holds(thread.ptrs, 16, ptrs[i]) && !pool_holds(ptrs, i, ptrs[i]));
+  }
+  for (size_t i = 0; i < holding; i += 1) {
+    check_fill(held[i], 64 << 10, 0x3C);
+    free(held[i]);
+  }
+  for (size_t i = 0; i < created; i += 1) {
+    pb_pool_destroy(live[i]);
+  }
+  pthread_barrier_destroy(&thread.barrier);
+}
+
+
+/*
+ * pb_mallctl(). Options read back what was written to them, values out of range and unknown names fail with
+ * EINVAL, and options that are fixed once the heap is set up fail with EPERM without changing.
+ */
+static void test_mallctl () {
+
+  long value;
+  long old;
+  long saved;
+
+  assert(pb_mallctl("narenas", &value, NULL) == 0 && value >= 1);
+  assert(pb_mallctl("numa", &value, NULL) == 0 && (value == 0 || value == 1));
+  assert(pb_mallctl("segment_size", &value, NULL) == 0 && value > 0);
+
+  assert(pb_mallctl("tcache_max", &saved, NULL) == 0);
+  value = 4;
+  assert(pb_mallctl("tcache_max", &old, &value) == 0 && old == saved);
+  assert(pb_mallctl("tcache_max", &value, NULL) == 0 && value == 4);
+  free(malloc(64));
+  assert(pb_mallctl("tcache_max", NULL, &saved) == 0);
+
+  assert(pb_mallctl("mmap_threshold", &saved, NULL) == 0);
+  value = 256 << 10;
+  assert(pb_mallctl("mmap_threshold", NULL, &value) == 0);
+  assert(pb_mallctl("mmap_threshold", &value, NULL) == 0 && value == 256 << 10);
+  void* large = malloc(300 << 10);
+  assert(large != NULL);
+  free(large);
+  assert(pb_mallctl("mmap_threshold", NULL, &saved) == 0);
+
+  errno = 0;
+  value = 1 << 20;
+  assert(pb_mallctl("tcache_max", NULL, &value) == -1 && errno == EINVAL);
+  errno = 0;
+  value = 16;
+  assert(pb_mallctl("mmap_threshold", NULL, &value) == -1 && errno == EINVAL);
+  errno = 0;
+  assert(pb_mallctl("no_such_option", &value, NULL) == -1 && errno == EINVAL);
+  errno = 0;
+  assert(pb_mallctl(NULL, &value, NULL) == -1 && errno == EINVAL);
+
+  //two values in range for each option, so that one of them differs from the current one
+  static const struct {
+    const char* name;
+    long        values[2];
+
+  } fixed[] = {
+    { "narenas",      { 1, 2 } },
+    { "numa",         { 0, 1 } },
+    { "fit",          { 0, 1 } },
+    { "segment_size", { 1 << 21, 1 << 22 } },
+  };
+  for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i += 1) {
+    assert(pb_mallctl(fixed[i].name, &saved, NULL) == 0);
+    value = fixed[i].values[saved == fixed[i].values[0]];
+    errno = 0;
+    assert(pb_mallctl(fixed[i].name, NULL, &value) == -1 && errno == EPERM);
+    assert(pb_mallctl(fixed[i].name, &value, NULL) == 0 && value == saved);
+  }
+
+  assert(pb_mallctl("flush", NULL, NULL) == 0);
+  assert(pb_mallctl("trim", &value, NULL) == 0 && (value == 0 || value == 1));
+}
+#if defined (PB_HARDEN)
+
+
+/*
+ * Hardening. Each of these misuses has to stop the program with SIGABRT when the block is freed, before the heap
+ * is corrupted. Each runs in a child whose stderr goes to /dev/null, so the report stays out of the output.
+ */
+static void double_free_block () {
+  void* volatile guard = malloc(4000);
+  void* volatile ptr   = malloc(4000);
+  void* volatile after = malloc(4000);
+  free(ptr);
+  free(ptr);
+  free(guard);
+  free(after);
+}
+
+static void double_free_slab () {
+  void* volatile ptr = malloc(32);
+  free(ptr);
+  malloc_trim(0);                          //gives the cached object back to its slab
+  free(ptr);
+}
+
+static void double_free_cached () {
+  void* volatile ptr = malloc(32);
+  free(ptr);
+  free(ptr);
+}
+
+static void corrupt_canary () {
+  size_t* volatile header = (size_t*) malloc(4000) - 4;     //the canary is the first of the header's four words
+  header[0] ^= 1;
+  free(header + 4);
+}
+
+//runs (misuse) in a child and checks that it aborts
+static void expect_abort (void (*misuse) ()) {
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDERR_FILENO);
+    misuse();
+    _exit(0);
+  }
+
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+static void test_harden () {
+  expect_abort(double_free_block);
+  expect_abort(double_free_slab);
+  expect_abort(double_free_cached);
+  expect_abort(corrupt_canary);
+}
+#endif
+
+
+int main (int argc, char** argv) {
+
+  if (argc > 1 && strcmp(argv[1], "profile") == 0) {
+    return child_profile();
+  }
+  if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+    child_trace();
+    return 0;
+  }
+
+  test_mallctl();
+  test_calloc_after_trim();
+  test_free_sized();
+  test_batch_fill();
+  test_batch_partial();
+  test_batch_mixed();
+  test_region();
+  test_pool();
+  test_cross_thread_free();
+  test_profile();
+  test_trace();
+  test_fork();
+#if defined (PB_HARDEN)
+  test_harden();
+#endif
+  test_stress();
+  test_calloc_after_trim();
+
+  printf("pb-test: all checks passed\n");
+  return 0;
+}